@@ -0,0 +1,48 @@
+#!/bin/sh
+# Space efficiency and write throughput of small, mid-size and large files, run from the directory holding myfs-pack
+#	./bench_blocks.sh [rounds]
+# Packs a tree of files of up to 3 KiB, one of 4 to 60 KiB and one of 64 KiB files into a scratch image rounds
+# times each (no FUSE needed): small files share fragment blocks, the big ones are written into large blocks
+
+ROUNDS=${1:-20}
+DIR=$(mktemp -d)
+
+mkdir "$DIR/small" "$DIR/mid" "$DIR/large"
+i=0
+while [ $i -lt 90 ]
+do
+	head -c $(( (i * 997) % 3000 + 1 )) /dev/urandom > "$DIR/small/f$i"
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt 80 ]
+do
+	head -c $(( (i * 7919) % 57344 + 4096 )) /dev/urandom > "$DIR/mid/f$i"
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt 80 ]
+do
+	head -c 65536 /dev/urandom > "$DIR/large/f$i"
+	i=$((i + 1))
+done
+
+for TREE in small mid large
+do
+	BYTES=$(cat "$DIR/$TREE"/* | wc -c)
+	START=$(date +%s%N)
+	r=0
+	while [ $r -lt $ROUNDS ]
+	do
+		: > "$DIR/image"
+		./myfs-pack "$DIR/$TREE" "$DIR/image" > "$DIR/out" || exit 1
+		r=$((r + 1))
+	done
+	END=$(date +%s%N)
+
+	USED=$(sed -n 's/ KiB of data space used//p' "$DIR/out")
+	echo "$TREE: $((BYTES / 1024)) KiB in files, $USED KiB used ($((BYTES * 100 / 1024 / USED))% efficient)," \
+		"$((BYTES * ROUNDS * 1000 / (END - START))) MB/s packed"
+done
+
+rm -r "$DIR"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Metadata-op latency of each I/O engine, run from the directory holding myfs and MyFileSystem
+#	./bench_engines.sh [ops]
+# Every op (create, setxattr, unlink) persists, so its latency includes whatever the engine waits for
+
+OPS=${1:-2000}
+MP=$(mktemp -d)
+
+for ENGINE in sync uring
+do
+	./myfs -o engine=$ENGINE "$MP" > /dev/null
+	sleep 1
+
+	START=$(date +%s%N)
+	i=0
+	while [ $i -lt $OPS ]
+	do
+		touch "$MP/bench"
+		setfattr -n user.bench -v 1 "$MP/bench"
+		rm "$MP/bench"
+		i=$((i + 1))
+	done
+	END=$(date +%s%N)
+
+	fusermount3 -u "$MP"
+	echo "$ENGINE: $(( (END - START) / (OPS * 3) / 1000 )) us per metadata op"
+done
+
+rmdir "$MP"
@@ -0,0 +1,1002 @@
+#define _GNU_SOURCE
+
+
+// Preprocessor Directives
+#include "myfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+
+// Macros
+#define MAX_THREADS 64
+#define CHUNK 1024										// Inodes / blocks a worker takes at a time in the bitmap passes
+#define MAX_REPORTED 20									// Problems of one kind printed before they are only counted
+#define SCRUB_RECHECK_US 200000							// Pause before an online scrub re-reads the image
+#define FRAG_OWNER -2									// block_owner of a block shared by fragment runs
+
+// Exit codes, as e2fsck
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+
+// Kinds of problems
+enum
+{
+	P_SUPER,						// superblock geometry doesn't match this build
+	P_DANGLING_DIRENT,				// entry points at a free or out of range inode
+	P_BAD_NAME,						// entry name holds a NUL or a '/'
+	P_BAD_RECORD,					// record lengths don't chain through the directory block
+	P_DIRENT_TYPE,					// entry type disagrees with the inode
+	P_MULTI_PARENT_DIR,				// directory referenced by more than one entry
+	P_UNREACHABLE_INODE,			// marked used in inode_map but no entry leads to it
+	P_USED_FLAG,					// inode -> used disagrees with inode_map
+	P_LINK_COUNT,
+	P_SIZE,							// a block or fragment of the file lies past its size, or the size past MAX_FILE_SIZE
+	P_BAD_BLOCK,					// block number out of range
+	P_DUP_BLOCK,					// block claimed by two owners
+	P_LEAKED_BLOCK,					// marked used in freemap but nothing refers to it
+	P_BLOCK_NOT_MARKED,				// in use but free in freemap
+	P_BAD_FRAG,						// fragment run of an inode out of its block, or along with other blocks
+	P_FRAG_MAP,						// freemap slot bits of a block of fragments disagree with the runs in it
+	P_XATTR_REFCOUNT,
+	P_XATTR_HEADER,
+	P_GROUP_COUNTS,
+	N_PROBLEMS
+};
+
+const char *problem_names[N_PROBLEMS] = {
+	"superblock doesn't match this build",
+	"directory entry points at a free inode",
+	"directory entry has an invalid name",
+	"directory block is corrupt from entry",
+	"directory entry has the wrong type",
+	"directory has more than one parent",
+	"inode is used but unreachable",
+	"inode used flag disagrees with inode_map",
+	"wrong link count",
+	"file size doesn't cover its data",
+	"block number out of range",
+	"block claimed twice",
+	"block is used but unreferenced (leaked)",
+	"block is referenced but marked free",
+	"inode has an invalid fragment run",
+	"block of fragments has the wrong freemap entry",
+	"wrong xattr block refcount",
+	"corrupt xattr block header",
+	"wrong group free counters",
+};
+
+
+// A problem found by a pass, id / extra locate it (inode, block, or directory + entry)
+// An entry is located by its byte offset in the directory, map index * BLK_SIZE + offset in the block
+typedef struct
+{
+	int kind;
+	int id;
+	int extra;
+} problem;
+
+
+// Problems found by one pass over the image
+typedef struct
+{
+	problem *list;
+	int n, cap;
+	pthread_mutex_t lock;
+} problem_list;
+
+
+// Helper Functions
+void usage();
+int read_image(const char *path, int flags);
+int read_at(const char *path, char *buf, size_t len, off_t offset);
+int stripe_io(bool write_back);
+void check_image(problem_list *found);
+void add_problem(problem_list *found, int kind, int id, int extra);
+bool has_problem(problem_list *found, problem *p);
+void run_parallel(void *(*fn)(void *));
+void *walk_worker(void *arg);
+void *inode_worker(void *arg);
+void *block_worker(void *arg);
+void push_dir(int ino);
+void claim_block(int blk, int owner);
+void claim_map(int ino);
+void claim_xattr(int ino);
+void claim_frags(int blk, int mask, int owner);
+void report(problem_list *found);
+bool repair(problem *p);
+void recount_groups();
+dirent *dirent_at(int dir, int at);
+unsigned int xattr_hash(const char *data, int len);
+int file_extent(inode *i);
+
+
+// Global Variables
+char *fs;												// The image, read whole into memory
+int fs_file;
+const char *devices[MAX_DEVICES];						// Data files of a striped image, given with -d in mount order
+int n_devices;
+superblock *sb;
+int *inode_map;
+inode *inodes;
+int *freemap;
+char *datablks;
+
+int n_threads;
+bool repair_mode, scrub_mode;
+
+int *refs;												// Directory entries pointing at each inode
+int *visited;											// Directories already queued by the walk
+int *block_owner;										// Inode whose data a block holds, -1 if none, FRAG_OWNER if shared by fragments
+int *frag_used;											// Slots of each block taken by fragment runs, as freemap bits
+int *xattr_refs;										// Inodes using each block as their xattr block
+
+int *dir_stack;											// Directories waiting to be scanned by the walk
+int dir_top;
+int walk_pending;										// Queued plus in-progress directories, the walk ends at 0
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+int next_chunk;											// Work distribution of the bitmap passes
+problem_list *current;									// List the workers of the running pass report to
+
+
+//-----------------------------------------------------------------------------------------MAIN (DRIVER) Function---------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	const char *image = "MyFileSystem";
+	int opt;
+
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while((opt = getopt(argc, argv, "nysj:d:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n': repair_mode = false; break;
+			case 'y': repair_mode = true; break;
+			case 's': scrub_mode = true; break;
+			case 'j': n_threads = atoi(optarg); break;
+			case 'd':
+				if(n_devices == MAX_DEVICES)
+				{
+					fprintf(stderr, "fsck.myfs: at most %d data files\n", MAX_DEVICES);
+					return FSCK_ERROR;
+				}
+				devices[n_devices++] = optarg;
+				break;
+			default: usage(); return FSCK_ERROR;
+		}
+	}
+	if(optind < argc)
+	{
+		image = argv[optind];
+	}
+	if(n_threads < 1)
+	{
+		n_threads = 1;
+	}
+	if(n_threads > MAX_THREADS)
+	{
+		n_threads = MAX_THREADS;
+	}
+	if(scrub_mode && repair_mode)
+	{
+		fprintf(stderr, "fsck.myfs: a scrub never repairs, -s and -y don't mix\n");
+		return FSCK_ERROR;
+	}
+
+	//a scrub reads a possibly mounted image and takes no lock, a check or repair needs it to itself
+	if(read_image(image, scrub_mode ? O_RDONLY : (repair_mode ? O_RDWR : O_RDONLY)) != 0)
+	{
+		return FSCK_ERROR;
+	}
+	if(!scrub_mode && flock(fs_file, LOCK_EX | LOCK_NB) != 0)
+	{
+		fprintf(stderr, "fsck.myfs: %s is mounted, use -s to scrub it online\n", image);
+		return FSCK_ERROR;
+	}
+
+	problem_list found = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+	check_image(&found);
+
+	//online, the daemon may have been half way through a change: only trust what a second look confirms
+	if(scrub_mode && found.n > 0)
+	{
+		problem_list again = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+		usleep(SCRUB_RECHECK_US);
+		free(fs);
+		close(fs_file);
+		if(read_image(image, O_RDONLY) != 0)
+		{
+			return FSCK_ERROR;
+		}
+		check_image(&again);
+
+		int kept = 0;
+		for(int i = 0; i < found.n; i++)
+		{
+			if(has_problem(&again, &found.list[i]))
+			{
+				found.list[kept++] = found.list[i];
+			}
+		}
+		found.n = kept;
+	}
+
+	report(&found);
+	if(found.n == 0)
+	{
+		printf("%s: clean\n", image);
+		return FSCK_OK;
+	}
+	if(!repair_mode)
+	{
+		return FSCK_UNCORRECTED;
+	}
+	for(int i = 0; i < found.n; i++)
+	{
+		//another version or geometry: not a byte of it may be written, it has to be rebuilt with myfs-pack
+		if(found.list[i].kind == P_SUPER)
+		{
+			printf("%s: not repaired, rebuild it with the myfs-pack that made it\n", image);
+			return FSCK_UNCORRECTED;
+		}
+	}
+
+	int left = 0;
+	for(int i = 0; i < found.n; i++)
+	{
+		if(!repair(&found.list[i]))
+		{
+			left++;
+		}
+	}
+	recount_groups();
+
+	ssize_t len = n_devices > 0 ? META_BLKS * BLK_SIZE : FS_SIZE;
+	if(pwrite(fs_file, fs, len, 0) != len || fsync(fs_file) != 0 || stripe_io(true) != 0)
+	{
+		perror("fsck.myfs: writing the repaired image");
+		return FSCK_ERROR;
+	}
+	printf("%s: %d problems repaired, %d left\n", image, found.n - left, left);
+	return left == 0 ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
+
+
+void usage()
+{
+	fprintf(stderr, "usage: fsck.myfs [-n | -y | -s] [-j threads] [-d datafile]... [image]\n");
+	fprintf(stderr, "\t-n\tcheck only (default)\n");
+	fprintf(stderr, "\t-y\trepair everything that can be repaired\n");
+	fprintf(stderr, "\t-s\tread-only online scrub of a mounted image\n");
+	fprintf(stderr, "\t-j\tworker threads (default: one per CPU)\n");
+	fprintf(stderr, "\t-d\tdata file of a striped image, once per file in mount order\n");
+}
+
+
+int read_image(const char *path, int flags)
+{
+	fs_file = open(path, flags);
+	if(fs_file < 0)
+	{
+		perror(path);
+		return -1;
+	}
+
+	//the metadata says whether the data blocks follow it or live in data files
+	struct stat buf;
+	fstat(fs_file, &buf);
+	if(buf.st_size < (off_t)(META_BLKS * BLK_SIZE))
+	{
+		fprintf(stderr, "fsck.myfs: %s is %ld bytes, expected %ld\n", path, (long)buf.st_size, (long)FS_SIZE);
+		return -1;
+	}
+
+	fs = calloc(1, FS_SIZE);
+	if(read_at(path, fs, META_BLKS * BLK_SIZE, 0) != 0)
+	{
+		return -1;
+	}
+
+	sb = (superblock *)fs;
+	inode_map = (int *)(fs + SUPER_BLKS * BLK_SIZE);
+	inodes = (inode *)((char *)inode_map + INODE_MAP_BLKS * BLK_SIZE);
+	freemap = (int *)((char *)inodes + INODE_BLKS * BLK_SIZE);
+	datablks = (char *)freemap + FREEMAP_BLKS * BLK_SIZE;
+
+	int striped = (sb -> magic == MYFS_MAGIC && sb -> version == MYFS_VERSION) ? sb -> n_devices : 0;
+	if(striped != n_devices)
+	{
+		fprintf(stderr, "fsck.myfs: %s has %d data files, %d given with -d\n", path, striped, n_devices);
+		return -1;
+	}
+	if(striped > 0 && (sb -> stripe_blks <= 0 || sb -> stripe_blks > DBLKS))
+	{
+		fprintf(stderr, "fsck.myfs: %s has a stripe unit of %d blocks\n", path, sb -> stripe_blks);
+		return -1;
+	}
+	if(striped > 0)
+	{
+		return stripe_io(false);
+	}
+
+	if(buf.st_size < (off_t)FS_SIZE)
+	{
+		fprintf(stderr, "fsck.myfs: %s is %ld bytes, expected %ld\n", path, (long)buf.st_size, (long)FS_SIZE);
+		return -1;
+	}
+	return read_at(path, fs + META_BLKS * BLK_SIZE, DBLKS * BLK_SIZE, META_BLKS * BLK_SIZE);
+}
+
+
+int read_at(const char *path, char *buf, size_t len, off_t offset)
+{
+	for(size_t done = 0; done < len; )
+	{
+		ssize_t n = pread(fs_file, buf + done, len - done, offset + done);
+		if(n <= 0)
+		{
+			perror(path);
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+
+//Read, or write back and sync, the data blocks of a striped image one stripe unit at a time
+//Past the end of a data file the blocks were never written and read as zeros
+//Reading checks each file's header first, the headers themselves are never rewritten
+int stripe_io(bool write_back)
+{
+	int stripe = sb -> stripe_blks;
+
+	for(int d = 0; d < n_devices; d++)
+	{
+		int fd = open(devices[d], write_back ? O_RDWR : O_RDONLY);
+		if(fd < 0)
+		{
+			perror(devices[d]);
+			return -1;
+		}
+
+		//repairing another image's data file into this one would wreck both
+		device_header hdr;
+		if(!write_back && (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) || hdr.magic != DEVICE_MAGIC
+			|| memcmp(hdr.uuid, sb -> uuid, sizeof(hdr.uuid)) != 0 || hdr.device != d || hdr.n_devices != n_devices))
+		{
+			fprintf(stderr, "fsck.myfs: %s is not data file %d of this image\n", devices[d], d);
+			close(fd);
+			return -1;
+		}
+
+		for(int blk = d * stripe; blk < DBLKS; blk += n_devices * stripe)
+		{
+			ssize_t len = (ssize_t)(blk + stripe <= DBLKS ? stripe : DBLKS - blk) * BLK_SIZE;
+			char *buf = datablks + (size_t)blk * BLK_SIZE;
+			off_t offset = STRIPE_OFFSET(blk, n_devices, stripe);
+			ssize_t n = write_back ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
+			if(n < 0 || (write_back && n != len))
+			{
+				perror(devices[d]);
+				close(fd);
+				return -1;
+			}
+		}
+		if(write_back && fsync(fd) != 0)
+		{
+			perror(devices[d]);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+	return 0;
+}
+
+
+//-----------------------------------------------------------------------------------------CHECKS---------------------------------------------------------------------------------------
+
+//One full pass: walk the tree from the root, then verify every inode and every block against it
+void check_image(problem_list *found)
+{
+	current = found;
+
+	if(sb -> magic != MYFS_MAGIC || sb -> version != MYFS_VERSION || sb -> n_groups != N_GROUPS
+		|| sb -> inodes_per_group != INODES_PER_GROUP || sb -> blocks_per_group != BLKS_PER_GROUP || sb -> root_inode != ROOT_INODE
+		|| (sb -> n_devices > 0 && (sb -> stripe_blks <= 0 || sb -> stripe_blks > DBLKS)))
+	{
+		//nothing else can be trusted, and nothing can be repaired
+		add_problem(found, P_SUPER, 0, 0);
+		return;
+	}
+
+	free(refs);
+	free(visited);
+	free(block_owner);
+	free(frag_used);
+	free(xattr_refs);
+	free(dir_stack);
+	refs = calloc(N_INODES, sizeof(int));
+	visited = calloc(N_INODES, sizeof(int));
+	block_owner = malloc(DBLKS * sizeof(int));
+	frag_used = calloc(DBLKS, sizeof(int));
+	xattr_refs = calloc(DBLKS, sizeof(int));
+	dir_stack = malloc(N_INODES * sizeof(int));
+	memset(block_owner, 0xff, DBLKS * sizeof(int));
+
+	//pass 1: reachability, every worker scans directories off a shared stack
+	claim_map(ROOT_INODE);
+	claim_xattr(ROOT_INODE);
+	visited[ROOT_INODE] = 1;
+	dir_top = 0;
+	walk_pending = 0;
+	push_dir(ROOT_INODE);
+	run_parallel(walk_worker);
+
+	//pass 2 and 3: inode and block bitmaps, in chunks handed out to the workers
+	next_chunk = 0;
+	run_parallel(inode_worker);
+	next_chunk = 0;
+	run_parallel(block_worker);
+
+	//group counters, cheap enough to do here
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		int free_inodes = 0, free_blocks = 0, n_dirs = 0;
+		for(int i = g * INODES_PER_GROUP; i < (g + 1) * INODES_PER_GROUP; i++)
+		{
+			free_inodes += (inode_map[i] == 0);
+			n_dirs += (inode_map[i] != 0 && (inodes + i) -> directory);
+		}
+		for(int b = g * BLKS_PER_GROUP; b < (g + 1) * BLKS_PER_GROUP; b++)
+		{
+			free_blocks += (freemap[b] == 1);
+		}
+		if(sb -> groups[g].free_inodes != free_inodes || sb -> groups[g].free_blocks != free_blocks || sb -> groups[g].n_dirs != n_dirs)
+		{
+			add_problem(found, P_GROUP_COUNTS, g, 0);
+		}
+	}
+}
+
+
+void add_problem(problem_list *found, int kind, int id, int extra)
+{
+	pthread_mutex_lock(&found -> lock);
+	if(found -> n == found -> cap)
+	{
+		found -> cap = found -> cap ? found -> cap * 2 : 64;
+		found -> list = realloc(found -> list, found -> cap * sizeof(problem));
+	}
+	found -> list[found -> n].kind = kind;
+	found -> list[found -> n].id = id;
+	found -> list[found -> n].extra = extra;
+	found -> n++;
+	pthread_mutex_unlock(&found -> lock);
+}
+
+
+bool has_problem(problem_list *found, problem *p)
+{
+	for(int i = 0; i < found -> n; i++)
+	{
+		if(found -> list[i].kind == p -> kind && found -> list[i].id == p -> id && found -> list[i].extra == p -> extra)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+//Run fn on n_threads threads and wait for all of them
+void run_parallel(void *(*fn)(void *))
+{
+	pthread_t threads[MAX_THREADS];
+
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_create(&threads[t], NULL, fn, NULL);
+	}
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+}
+
+
+void push_dir(int ino)
+{
+	pthread_mutex_lock(&walk_lock);
+	dir_stack[dir_top++] = ino;
+	walk_pending++;
+	pthread_cond_signal(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+
+//Note that blk holds owner's data, two owners for one block is a problem
+void claim_block(int blk, int owner)
+{
+	if(blk < 0 || blk >= DBLKS)
+	{
+		add_problem(current, P_BAD_BLOCK, owner, blk);
+		return;
+	}
+
+	int none = -1;
+	if(!__atomic_compare_exchange_n(&block_owner[blk], &none, owner, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		add_problem(current, P_DUP_BLOCK, blk, owner);
+	}
+}
+
+
+//Note that blk holds a fragment run (the slots in mask) of owner, runs of different owners may share it
+void claim_frags(int blk, int mask, int owner)
+{
+	if(blk < 0 || blk >= DBLKS)
+	{
+		add_problem(current, P_BAD_BLOCK, owner, blk);
+		return;
+	}
+
+	int none = -1;
+	if(!__atomic_compare_exchange_n(&block_owner[blk], &none, FRAG_OWNER, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && none != FRAG_OWNER)
+	{
+		add_problem(current, P_DUP_BLOCK, blk, owner);
+	}
+	else if(__atomic_fetch_or(&frag_used[blk], mask, __ATOMIC_RELAXED) & mask)
+	{
+		add_problem(current, P_DUP_BLOCK, blk, owner);
+	}
+}
+
+
+//Count the inode's reference to its shared xattr block, checked against the block's refcount later
+void claim_xattr(int ino)
+{
+	int xblk = (inodes + ino) -> xattr_blk;
+	if(xblk == 0)
+	{
+		return;
+	}
+	if(xblk < 0 || xblk >= DBLKS)
+	{
+		add_problem(current, P_BAD_BLOCK, ino, xblk);
+		return;
+	}
+	__atomic_fetch_add(&xattr_refs[xblk], 1, __ATOMIC_RELAXED);
+}
+
+
+//Claim every block in the inode's block map, or its fragment run
+void claim_map(int ino)
+{
+	inode *temp = inodes + ino;
+	if(temp -> frag >= 0)
+	{
+		bool valid = !temp -> directory && temp -> n_frags > 0 && temp -> frag + temp -> n_frags <= FRAGS_PER_BLK;
+		for(int k = 1; k < DBLKS_PER_INODE; k++)
+		{
+			valid = valid && temp -> data[k] == NO_BLOCK;
+		}
+		if(!valid)
+		{
+			add_problem(current, P_BAD_FRAG, ino, 0);
+			return;
+		}
+		claim_frags(temp -> data[0], FRAG_BITS(temp -> n_frags, temp -> frag), ino);
+		return;
+	}
+
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if((inodes + ino) -> data[i] != NO_BLOCK)
+		{
+			claim_block((inodes + ino) -> data[i], ino);
+		}
+	}
+}
+
+
+//Scan directories until none are queued or being scanned
+void *walk_worker(void *arg)
+{
+	(void) arg;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&walk_lock);
+		while(dir_top == 0 && walk_pending > 0)
+		{
+			pthread_cond_wait(&walk_cond, &walk_lock);
+		}
+		if(dir_top == 0)
+		{
+			pthread_mutex_unlock(&walk_lock);
+			return NULL;
+		}
+		int dir = dir_stack[--dir_top];
+		pthread_mutex_unlock(&walk_lock);
+
+		for(int i = 0; i < DBLKS_PER_INODE; i++)
+		{
+			//out of range blocks were reported when the directory was claimed
+			int data = (inodes + dir) -> data[i];
+			if(data < 0 || data >= DBLKS)
+			{
+				continue;
+			}
+
+			char *blk = datablks + data * BLK_SIZE;
+			for(int off = 0; off < BLK_SIZE; off += ((dirent *)(blk + off)) -> rec_len)
+			{
+				dirent *temp = (dirent *)(blk + off);
+				int at = i * BLK_SIZE + off;
+
+				//past a bad length nothing in the block can be found
+				if(temp -> rec_len < DIRENT_HDR_SIZE || temp -> rec_len % 4 != 0 || off + temp -> rec_len > BLK_SIZE
+					|| (temp -> name_len != 0 && (int)DIRENT_LEN(temp -> name_len) > temp -> rec_len))
+				{
+					add_problem(current, P_BAD_RECORD, dir, at);
+					break;
+				}
+				if(temp -> name_len == 0)
+				{
+					continue;
+				}
+				if(memchr(temp -> name, '\0', temp -> name_len) != NULL || memchr(temp -> name, '/', temp -> name_len) != NULL)
+				{
+					add_problem(current, P_BAD_NAME, dir, at);
+					continue;
+				}
+
+				int child = temp -> file_inode;
+				if(child <= ROOT_INODE || child >= N_INODES || inode_map[child] == 0)
+				{
+					add_problem(current, P_DANGLING_DIRENT, dir, at);
+					continue;
+				}
+				if(temp -> type != ((inodes + child) -> directory ? FT_DIR : FT_REG))
+				{
+					add_problem(current, P_DIRENT_TYPE, dir, at);
+				}
+
+				//the first entry to reach an inode claims its blocks
+				if(__atomic_fetch_add(&refs[child], 1, __ATOMIC_RELAXED) == 0)
+				{
+					claim_map(child);
+					claim_xattr(child);
+				}
+				else if((inodes + child) -> directory)
+				{
+					add_problem(current, P_MULTI_PARENT_DIR, dir, at);
+					continue;
+				}
+
+				if((inodes + child) -> directory && __atomic_exchange_n(&visited[child], 1, __ATOMIC_RELAXED) == 0)
+				{
+					push_dir(child);
+				}
+			}
+		}
+
+		pthread_mutex_lock(&walk_lock);
+		if(--walk_pending == 0)
+		{
+			pthread_cond_broadcast(&walk_cond);
+		}
+		pthread_mutex_unlock(&walk_lock);
+	}
+}
+
+
+//Bytes up to the end of the file's last block or of its fragment run
+//Writes and truncates never leave anything past the size (holes before it are fine), so size must reach this
+int file_extent(inode *i)
+{
+	if(i -> frag >= 0)
+	{
+		return i -> n_frags * FRAG_SIZE;
+	}
+
+	int end = DBLKS_PER_INODE;
+	while(end > 0 && i -> data[end - 1] == NO_BLOCK)
+	{
+		end--;
+	}
+	return end * BLK_SIZE;
+}
+
+
+void *inode_worker(void *arg)
+{
+	(void) arg;
+
+	for(;;)
+	{
+		int start = __atomic_fetch_add(&next_chunk, CHUNK, __ATOMIC_RELAXED);
+		if(start >= N_INODES)
+		{
+			return NULL;
+		}
+
+		int end = start + CHUNK < N_INODES ? start + CHUNK : N_INODES;
+		for(int ino = start; ino < end; ino++)
+		{
+			inode *i = inodes + ino;
+			bool used = inode_map[ino] != 0;
+			bool reachable = (ino == ROOT_INODE) || refs[ino] > 0;
+
+			if(i -> used != used)
+			{
+				add_problem(current, P_USED_FLAG, ino, 0);
+			}
+			if(used && !reachable)
+			{
+				add_problem(current, P_UNREACHABLE_INODE, ino, 0);
+			}
+			if(!used || !reachable)
+			{
+				continue;
+			}
+
+			if(i -> directory ? i -> link_count != 2 : i -> link_count != refs[ino])
+			{
+				add_problem(current, P_LINK_COUNT, ino, 0);
+			}
+			size_t unit = i -> frag >= 0 ? FRAG_SIZE : BLK_SIZE;
+			if(!i -> directory && (i -> size > MAX_FILE_SIZE || ROUND_UP_DIV(i -> size, unit) * unit < (size_t)file_extent(i)))
+			{
+				add_problem(current, P_SIZE, ino, 0);
+			}
+		}
+	}
+}
+
+
+void *block_worker(void *arg)
+{
+	(void) arg;
+
+	for(;;)
+	{
+		int start = __atomic_fetch_add(&next_chunk, CHUNK, __ATOMIC_RELAXED);
+		if(start >= DBLKS)
+		{
+			return NULL;
+		}
+
+		int end = start + CHUNK < DBLKS ? start + CHUNK : DBLKS;
+		for(int blk = start; blk < end; blk++)
+		{
+			bool used = freemap[blk] != 1;
+			bool referenced = block_owner[blk] != -1 || xattr_refs[blk] > 0;
+			bool frags = block_owner[blk] == FRAG_OWNER;
+
+			if(block_owner[blk] != -1 && xattr_refs[blk] > 0)
+			{
+				add_problem(current, P_DUP_BLOCK, blk, -1);
+			}
+			if(used && !referenced)
+			{
+				add_problem(current, P_LEAKED_BLOCK, blk, 0);
+			}
+			if(frags && freemap[blk] != (FRAG_BLOCK | frag_used[blk]))
+			{
+				add_problem(current, P_FRAG_MAP, blk, 0);
+			}
+			else if(!frags && !used && referenced)
+			{
+				add_problem(current, P_BLOCK_NOT_MARKED, blk, 0);
+			}
+			else if(!frags && used && referenced && freemap[blk] != 0)
+			{
+				add_problem(current, P_FRAG_MAP, blk, 0);
+			}
+
+			if(xattr_refs[blk] > 0)
+			{
+				xattr_header *hdr = (xattr_header *)(datablks + blk * BLK_SIZE);
+				if(hdr -> used < 0 || hdr -> used > (int)XATTR_BLK_SPACE || hdr -> hash != xattr_hash((char *)(hdr + 1), hdr -> used))
+				{
+					add_problem(current, P_XATTR_HEADER, blk, 0);
+				}
+				else if(hdr -> refcount != xattr_refs[blk])
+				{
+					add_problem(current, P_XATTR_REFCOUNT, blk, 0);
+				}
+			}
+		}
+	}
+}
+
+
+//FNV-1a, as myfs hashes shared xattr blocks
+unsigned int xattr_hash(const char *data, int len)
+{
+	unsigned int h = 2166136261u;
+	for(int i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return h;
+}
+
+
+//-----------------------------------------------------------------------------------------REPORT AND REPAIR---------------------------------------------------------------------------------------
+
+void report(problem_list *found)
+{
+	int counts[N_PROBLEMS] = { 0 };
+
+	for(int i = 0; i < found -> n; i++)
+	{
+		problem *p = &found -> list[i];
+		if(counts[p -> kind]++ < MAX_REPORTED)
+		{
+			printf("%s: %d", problem_names[p -> kind], p -> id);
+			if(p -> kind == P_DANGLING_DIRENT || p -> kind == P_BAD_NAME || p -> kind == P_MULTI_PARENT_DIR
+				|| p -> kind == P_BAD_RECORD || p -> kind == P_DIRENT_TYPE)
+			{
+				printf(" (entry at %d)", p -> extra);
+			}
+			printf("\n");
+		}
+	}
+	for(int k = 0; k < N_PROBLEMS; k++)
+	{
+		if(counts[k] > MAX_REPORTED)
+		{
+			printf("%s: %d more\n", problem_names[k], counts[k] - MAX_REPORTED);
+		}
+	}
+}
+
+
+//Fix one problem in the in-memory image, returns false if it can't be fixed
+//Freed inodes leave their blocks unreferenced, those show up (and are freed) as leaked blocks
+bool repair(problem *p)
+{
+	switch(p -> kind)
+	{
+		case P_DANGLING_DIRENT:
+		case P_BAD_NAME:
+		case P_MULTI_PARENT_DIR:
+		{
+			//turn the entry into a free record, its length keeps the chain intact
+			dirent *temp = dirent_at(p -> id, p -> extra);
+			temp -> file_inode = 0;
+			temp -> name_len = 0;
+			return true;
+		}
+
+		case P_DIRENT_TYPE:
+		{
+			dirent *temp = dirent_at(p -> id, p -> extra);
+			temp -> type = (inodes + temp -> file_inode) -> directory ? FT_DIR : FT_REG;
+			return true;
+		}
+
+		case P_BAD_RECORD:
+		{
+			//salvage what comes before the bad record: the one ahead of it is stretched to the end of the block
+			char *blk = (char *)dirent_at(p -> id, p -> extra - p -> extra % BLK_SIZE);
+			int bad = p -> extra % BLK_SIZE, prev = -1;
+			for(int off = 0; off != bad; off += ((dirent *)(blk + off)) -> rec_len)
+			{
+				prev = off;
+			}
+			if(prev == -1)
+			{
+				dirent *first = (dirent *)blk;
+				first -> file_inode = 0;
+				first -> rec_len = BLK_SIZE;
+				first -> name_len = 0;
+			}
+			else
+			{
+				((dirent *)(blk + prev)) -> rec_len = BLK_SIZE - prev;
+			}
+			return true;
+		}
+
+		case P_UNREACHABLE_INODE:
+			inode_map[p -> id] = 0;
+			(inodes + p -> id) -> used = false;
+			return true;
+
+		case P_USED_FLAG:
+			(inodes + p -> id) -> used = inode_map[p -> id] != 0;
+			return true;
+
+		case P_LINK_COUNT:
+			(inodes + p -> id) -> link_count = (inodes + p -> id) -> directory ? 2 : refs[p -> id];
+			return true;
+
+		case P_SIZE:
+			//the size grows over what is there rather than the data being thrown away
+			(inodes + p -> id) -> size = file_extent(inodes + p -> id);
+			return true;
+
+		case P_LEAKED_BLOCK:
+			freemap[p -> id] = 1;
+			return true;
+
+		case P_BLOCK_NOT_MARKED:
+			freemap[p -> id] = 0;
+			return true;
+
+		case P_BAD_FRAG:
+		{
+			//its blocks were not claimed, they are freed as leaked
+			inode *i = inodes + p -> id;
+			memset(i -> data, 0xff, sizeof(i -> data));
+			i -> frag = -1;
+			i -> n_frags = 0;
+			i -> size = 0;
+			return true;
+		}
+
+		case P_FRAG_MAP:
+			freemap[p -> id] = block_owner[p -> id] == FRAG_OWNER ? FRAG_BLOCK | frag_used[p -> id] : 0;
+			return true;
+
+		case P_XATTR_REFCOUNT:
+			((xattr_header *)(datablks + p -> id * BLK_SIZE)) -> refcount = xattr_refs[p -> id];
+			return true;
+
+		case P_GROUP_COUNTS:
+			//recount_groups runs after all repairs
+			return true;
+
+		default:
+			//superblock, bad and doubly claimed blocks, corrupt xattr blocks need a human
+			return false;
+	}
+}
+
+
+//The entry at byte at of the directory dir, as problems locate them
+dirent *dirent_at(int dir, int at)
+{
+	return (dirent *)(datablks + (inodes + dir) -> data[at / BLK_SIZE] * BLK_SIZE + at % BLK_SIZE);
+}
+
+
+//Recompute every group's counters from the (repaired) bitmaps
+void recount_groups()
+{
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		group_desc *gd = &sb -> groups[g];
+		gd -> free_inodes = 0;
+		gd -> free_blocks = 0;
+		gd -> n_dirs = 0;
+
+		for(int i = g * INODES_PER_GROUP; i < (g + 1) * INODES_PER_GROUP; i++)
+		{
+			gd -> free_inodes += (inode_map[i] == 0);
+			gd -> n_dirs += (inode_map[i] != 0 && (inodes + i) -> directory);
+		}
+		for(int b = g * BLKS_PER_GROUP; b < (g + 1) * BLKS_PER_GROUP; b++)
+		{
+			gd -> free_blocks += (freemap[b] == 1);
+		}
+	}
+}
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+
+
+// Preprocessor Directives
+#include "io_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+// Macros
+#define MAX_QUEUED 128									// Writes gathered between two submits
+#define URING_ENTRIES 256								// Room for a full batch plus one fsync per file
+#define MAX_FILES 16									// Backing files the uring engine keeps sync state for
+#define SHUTDOWN_TAG ((__u64)-1)						// user_data of the NOP that stops the reaper
+
+
+// A write waiting for submit
+typedef struct
+{
+	int fd;
+	const char *buf;
+	size_t len;
+	off_t offset;
+} io_request;
+
+
+// Group commit state of one backing file
+// At most one fdatasync per file is in flight, writes submitted meanwhile ask for another one
+typedef struct
+{
+	int fd;
+	int writes_inflight;
+	bool sync_inflight;
+	bool sync_wanted;			// Writes were submitted that the running fdatasync doesn't cover
+} uring_file;
+
+
+// One io_uring instance, each mount that picks the engine has its own
+typedef struct
+{
+	int ring_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	char *fixed_base;										// The registered image, NULL if registering failed
+	size_t fixed_len;
+
+	io_request queued[MAX_QUEUED];
+	int n_queued;
+
+	uring_file files[MAX_FILES];
+	int n_files;
+	pthread_mutex_t sq_lock;								// Guards the SQ ring and files[], handlers and the reaper both submit
+
+	int inflight;											// Submitted SQEs whose completion hasn't been reaped
+	pthread_mutex_t inflight_lock;
+	pthread_cond_t inflight_cond;
+	pthread_t reaper_thread;
+} uring_ring;
+
+
+// Engine Prototypes
+static int sync_setup(char *image, size_t len, void **state);
+static void sync_queue_write(void *state, int fd, const char *buf, size_t len, off_t offset);
+static void sync_submit(void *state);
+static void sync_shutdown(void *state);
+
+static int uring_setup(char *image, size_t len, void **state);
+static void uring_queue_write(void *state, int fd, const char *buf, size_t len, off_t offset);
+static void uring_submit(void *state);
+static void uring_shutdown(void *state);
+static void *uring_reaper(void *arg);
+static uring_file *uring_file_of(uring_ring *r, int fd);
+static struct io_uring_sqe *uring_get_sqe(uring_ring *r, unsigned *tail);
+static void uring_enter(uring_ring *r, int to_submit);
+
+
+io_engine sync_engine = {
+	.name			= "sync",
+	.setup			= sync_setup,
+	.queue_write	= sync_queue_write,
+	.submit			= sync_submit,
+	.shutdown		= sync_shutdown,
+};
+
+io_engine uring_engine = {
+	.name			= "uring",
+	.setup			= uring_setup,
+	.queue_write	= uring_queue_write,
+	.submit			= uring_submit,
+	.shutdown		= uring_shutdown,
+};
+
+
+io_engine *find_io_engine(const char *name)
+{
+	if(strcmp(name, sync_engine.name) == 0)
+	{
+		return &sync_engine;
+	}
+	if(strcmp(name, uring_engine.name) == 0)
+	{
+		return &uring_engine;
+	}
+	return NULL;
+}
+
+
+//-----------------------------------------------------------------------------------------SYNC ENGINE---------------------------------------------------------------------------------------
+
+static int sync_setup(char *image, size_t len, void **state)
+{
+	(void) image;
+	(void) len;
+	*state = NULL;
+	return 0;
+}
+
+
+static void sync_queue_write(void *state, int fd, const char *buf, size_t len, off_t offset)
+{
+	(void) state;
+
+	while(len > 0)
+	{
+		ssize_t n = pwrite(fd, buf, len, offset);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			perror("pwrite");
+			return;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+
+static void sync_submit(void *state)
+{
+	(void) state;
+}
+
+
+static void sync_shutdown(void *state)
+{
+	(void) state;
+}
+
+
+//-----------------------------------------------------------------------------------------IO_URING ENGINE---------------------------------------------------------------------------------------
+
+//Map the rings, register the image as a fixed buffer and start the reaper
+static int uring_setup(char *image, size_t len, void **state)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	uring_ring *r = calloc(1, sizeof(uring_ring));
+	if(r == NULL)
+	{
+		return -1;
+	}
+
+	r -> ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(r -> ring_fd < 0)
+	{
+		perror("io_uring_setup");
+		free(r);
+		return -1;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> ring_fd, IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> ring_fd, IORING_OFF_CQ_RING);
+	r -> sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> ring_fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || cq == MAP_FAILED || r -> sqes == MAP_FAILED)
+	{
+		perror("io_uring mmap");
+		close(r -> ring_fd);
+		free(r);
+		return -1;
+	}
+
+	r -> sq_head = (unsigned *)(sq + p.sq_off.head);
+	r -> sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r -> sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r -> sq_array = (unsigned *)(sq + p.sq_off.array);
+	r -> cq_head = (unsigned *)(cq + p.cq_off.head);
+	r -> cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r -> cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r -> cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r -> sq_entries = p.sq_entries;
+
+	//pinning the image saves the kernel a page walk per write, it is only an optimisation
+	struct iovec iov = { image, len };
+	if(syscall(__NR_io_uring_register, r -> ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+	{
+		r -> fixed_base = image;
+		r -> fixed_len = len;
+	}
+	else
+	{
+		perror("io_uring: registering the image, using plain writes");
+	}
+
+	pthread_mutex_init(&r -> sq_lock, NULL);
+	pthread_mutex_init(&r -> inflight_lock, NULL);
+	pthread_cond_init(&r -> inflight_cond, NULL);
+	pthread_create(&r -> reaper_thread, NULL, uring_reaper, r);
+
+	#ifdef DEBUG
+	printf("io_uring engine ready, %u entries, %s buffers\n", r -> sq_entries, r -> fixed_base ? "fixed" : "plain");
+	#endif
+	*state = r;
+	return 0;
+}
+
+
+static void uring_queue_write(void *state, int fd, const char *buf, size_t len, off_t offset)
+{
+	uring_ring *r = state;
+
+	//a full batch goes out right away, the caller's next submit picks up the rest
+	if(r -> n_queued == MAX_QUEUED)
+	{
+		uring_submit(r);
+	}
+
+	r -> queued[r -> n_queued].fd = fd;
+	r -> queued[r -> n_queued].buf = buf;
+	r -> queued[r -> n_queued].len = len;
+	r -> queued[r -> n_queued].offset = offset;
+	r -> n_queued++;
+}
+
+
+//Next free SQE, the caller holds sq_lock and has made sure there is room
+static struct io_uring_sqe *uring_get_sqe(uring_ring *r, unsigned *tail)
+{
+	unsigned index = *tail & *r -> sq_mask;
+	struct io_uring_sqe *sqe = &r -> sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r -> sq_array[index] = index;
+	(*tail)++;
+	return sqe;
+}
+
+
+//Sync state slot of a backing file, called with sq_lock held
+static uring_file *uring_file_of(uring_ring *r, int fd)
+{
+	for(int i = 0; i < r -> n_files; i++)
+	{
+		if(r -> files[i].fd == fd)
+		{
+			return &r -> files[i];
+		}
+	}
+
+	//persist_fs only ever writes to a handful of files, MAX_FILES is plenty
+	if(r -> n_files == MAX_FILES)
+	{
+		fprintf(stderr, "io_uring: more than %d backing files\n", MAX_FILES);
+		abort();
+	}
+	r -> files[r -> n_files].fd = fd;
+	return &r -> files[r -> n_files++];
+}
+
+
+static void uring_enter(uring_ring *r, int to_submit)
+{
+	while(to_submit > 0)
+	{
+		int res = syscall(__NR_io_uring_enter, r -> ring_fd, to_submit, 0, 0, NULL, 0);
+		if(res < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			{
+				continue;
+			}
+			perror("io_uring_enter");
+			break;
+		}
+		to_submit -= res;
+	}
+}
+
+
+//The queued writes of each file go out in queue order
+//If the file has no write or fdatasync outstanding, they are linked to a fresh fdatasync
+//which then covers everything written so far; otherwise the reaper issues one after them
+//The caller (persist_fs) serialises queue_write and submit
+static void uring_submit(void *state)
+{
+	uring_ring *r = state;
+
+	if(r -> n_queued == 0)
+	{
+		return;
+	}
+
+	//completions of earlier batches must leave room in the rings: every write plus
+	//at most one fsync per file, whatever is not used is handed back below
+	int reserved = r -> n_queued + MAX_FILES;
+	pthread_mutex_lock(&r -> inflight_lock);
+	while(r -> inflight + reserved > (int)r -> sq_entries)
+	{
+		pthread_cond_wait(&r -> inflight_cond, &r -> inflight_lock);
+	}
+	r -> inflight += reserved;
+	pthread_mutex_unlock(&r -> inflight_lock);
+
+	pthread_mutex_lock(&r -> sq_lock);
+	unsigned tail = *r -> sq_tail;
+	int n_sqes = 0;
+	bool done[MAX_QUEUED] = { false };
+	io_request *queued = r -> queued;
+
+	for(int i = 0; i < r -> n_queued; i++)
+	{
+		if(done[i])
+		{
+			continue;
+		}
+
+		uring_file *f = uring_file_of(r, queued[i].fd);
+		bool link_sync = !f -> sync_inflight && f -> writes_inflight == 0;
+
+		for(int j = i; j < r -> n_queued; j++)
+		{
+			if(done[j] || queued[j].fd != f -> fd)
+			{
+				continue;
+			}
+
+			struct io_uring_sqe *sqe = uring_get_sqe(r, &tail);
+			bool is_fixed = r -> fixed_base != NULL && queued[j].buf >= r -> fixed_base && queued[j].buf + queued[j].len <= r -> fixed_base + r -> fixed_len;
+			sqe -> opcode = is_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+			sqe -> fd = f -> fd;
+			sqe -> addr = (unsigned long)queued[j].buf;
+			sqe -> len = queued[j].len;
+			sqe -> off = queued[j].offset;
+			sqe -> buf_index = 0;
+			sqe -> flags = link_sync ? IOSQE_IO_LINK : 0;
+			sqe -> user_data = ((__u64)(f - r -> files) << 8) | IORING_OP_WRITE;
+			f -> writes_inflight++;
+			n_sqes++;
+			done[j] = true;
+		}
+
+		if(link_sync)
+		{
+			struct io_uring_sqe *sqe = uring_get_sqe(r, &tail);
+			sqe -> opcode = IORING_OP_FSYNC;
+			sqe -> fd = f -> fd;
+			sqe -> fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe -> user_data = ((__u64)(f - r -> files) << 8) | IORING_OP_FSYNC;
+			f -> sync_inflight = true;
+			f -> sync_wanted = false;
+			n_sqes++;
+		}
+		else
+		{
+			f -> sync_wanted = true;
+		}
+	}
+
+	__atomic_store_n(r -> sq_tail, tail, __ATOMIC_RELEASE);
+	r -> n_queued = 0;
+	uring_enter(r, n_sqes);
+	pthread_mutex_unlock(&r -> sq_lock);
+
+	pthread_mutex_lock(&r -> inflight_lock);
+	r -> inflight -= reserved - n_sqes;
+	pthread_cond_broadcast(&r -> inflight_cond);
+	pthread_mutex_unlock(&r -> inflight_lock);
+}
+
+
+//Dedicated completion thread of one ring, handlers never wait for the disk
+//It also issues the follow-up fdatasync of files whose writes have all landed
+static void *uring_reaper(void *arg)
+{
+	uring_ring *r = arg;
+	bool stop = false;
+
+	while(!stop)
+	{
+		if(syscall(__NR_io_uring_enter, r -> ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+		{
+			perror("io_uring_enter (reaper)");
+		}
+
+		pthread_mutex_lock(&r -> sq_lock);
+		unsigned head = *r -> cq_head;
+		unsigned tail = __atomic_load_n(r -> cq_tail, __ATOMIC_ACQUIRE);
+		int reaped = 0;
+
+		for(; head != tail; head++, reaped++)
+		{
+			struct io_uring_cqe *cqe = &r -> cqes[head & *r -> cq_mask];
+
+			if(cqe -> user_data == SHUTDOWN_TAG)
+			{
+				stop = true;
+				continue;
+			}
+
+			uring_file *f = &r -> files[cqe -> user_data >> 8];
+			int op = cqe -> user_data & 0xff;
+			if(op == IORING_OP_FSYNC)
+			{
+				f -> sync_inflight = false;
+			}
+			else
+			{
+				f -> writes_inflight--;
+			}
+
+			if(cqe -> res < 0)
+			{
+				//a failed write cancels the rest of its chain, including the fsync
+				fprintf(stderr, "io_uring: %s of fd %d failed: %s\n", op == IORING_OP_FSYNC ? "fsync" : "write", f -> fd, strerror(-(cqe -> res)));
+			}
+		}
+		__atomic_store_n(r -> cq_head, head, __ATOMIC_RELEASE);
+
+		//group commit: one fdatasync for everything written while the last one ran
+		int follow_ups = 0;
+		unsigned sq = *r -> sq_tail;
+		for(int i = 0; i < r -> n_files; i++)
+		{
+			uring_file *f = &r -> files[i];
+			if(f -> sync_wanted && !f -> sync_inflight && f -> writes_inflight == 0)
+			{
+				struct io_uring_sqe *sqe = uring_get_sqe(r, &sq);
+				sqe -> opcode = IORING_OP_FSYNC;
+				sqe -> fd = f -> fd;
+				sqe -> fsync_flags = IORING_FSYNC_DATASYNC;
+				sqe -> user_data = ((__u64)i << 8) | IORING_OP_FSYNC;
+				f -> sync_inflight = true;
+				f -> sync_wanted = false;
+				follow_ups++;
+			}
+		}
+		if(follow_ups > 0)
+		{
+			//room is guaranteed: the CQ ring is twice URING_ENTRIES and at most MAX_FILES of these exist
+			__atomic_store_n(r -> sq_tail, sq, __ATOMIC_RELEASE);
+			uring_enter(r, follow_ups);
+		}
+		pthread_mutex_unlock(&r -> sq_lock);
+
+		//follow-ups are counted before the reaped ones leave, so inflight never dips to 0 early
+		pthread_mutex_lock(&r -> inflight_lock);
+		r -> inflight += follow_ups - reaped;
+		pthread_cond_broadcast(&r -> inflight_cond);
+		pthread_mutex_unlock(&r -> inflight_lock);
+	}
+	return NULL;
+}
+
+
+//Drain the ring, stop its reaper and free it
+static void uring_shutdown(void *state)
+{
+	uring_ring *r = state;
+	uring_submit(r);
+
+	//drain, then a NOP tells the reaper to leave (completions can arrive in any order)
+	pthread_mutex_lock(&r -> inflight_lock);
+	while(r -> inflight > 0)
+	{
+		pthread_cond_wait(&r -> inflight_cond, &r -> inflight_lock);
+	}
+	r -> inflight++;
+	pthread_mutex_unlock(&r -> inflight_lock);
+
+	pthread_mutex_lock(&r -> sq_lock);
+	unsigned tail = *r -> sq_tail;
+	struct io_uring_sqe *sqe = uring_get_sqe(r, &tail);
+	sqe -> opcode = IORING_OP_NOP;
+	sqe -> user_data = SHUTDOWN_TAG;
+	__atomic_store_n(r -> sq_tail, tail, __ATOMIC_RELEASE);
+	uring_enter(r, 1);
+	pthread_mutex_unlock(&r -> sq_lock);
+
+	pthread_join(r -> reaper_thread, NULL);
+	close(r -> ring_fd);
+	pthread_mutex_destroy(&r -> sq_lock);
+	pthread_mutex_destroy(&r -> inflight_lock);
+	pthread_cond_destroy(&r -> inflight_cond);
+	free(r);
+}
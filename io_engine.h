@@ -0,0 +1,28 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+// Backing store I/O engine, persist_fs hands it the dirty parts of the image
+// Writes are gathered with queue_write and handed to the device by submit,
+// an engine is free to return from submit before the data reaches the disk
+// Every mount sets up its own instance: setup hands back the state the other calls take
+typedef struct
+{
+	const char *name;
+	int (*setup)(char *image, size_t len, void **state);			// Memory every queued buffer lives in, 0 on success
+	void (*queue_write)(void *state, int fd, const char *buf, size_t len, off_t offset);
+	void (*submit)(void *state);
+	void (*shutdown)(void *state);									// Returns once everything submitted has completed, and frees the state
+} io_engine;
+
+
+// Engines
+extern io_engine sync_engine;			// pwrite from the calling thread, same durability as before (page cache)
+extern io_engine uring_engine;			// io_uring: batched writes from registered memory, each batch chained to an fdatasync
+
+io_engine *find_io_engine(const char *name);
+
+#endif
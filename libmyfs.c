@@ -0,0 +1,2777 @@
+#define _GNU_SOURCE
+
+
+// Preprocessor Directives
+#include "libmyfs.h"
+#include "myfs.h"
+#include "io_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/xattr.h>
+#include <sys/file.h>
+#include <sys/random.h>
+
+
+// Macros
+#define XATTR_INDEX_SIZE 64
+#define XATTR_CACHE_SIZE 512
+
+
+// In-memory cache of (inode, name) -> value, negative results included
+typedef struct
+{
+	int ino;					// -1 when the slot is empty
+	unsigned int gen;			// xattr_gen[ino] when filled, stale once the inode's attributes change
+	char name[32];
+	int value_len;				// -1 when the inode has no such attribute
+	char value[64];
+} xattr_cache_entry;
+
+
+// What a load_device thread reads
+typedef struct
+{
+	myfs *m;
+	int dev;
+} device_job;
+
+
+// A mounted image: the whole image in memory plus what is kept alongside it
+struct myfs
+{
+	int fs_file;
+	int n_devices;											// Data files the data blocks are striped over, 0 if they live in fs_file
+	int stripe_blks;
+	int dev_files[MAX_DEVICES];
+	int flags;												// MYFS_* passed to myfs_mount
+	char *fs;												// The start of the FileSystem in the memory
+	superblock *sb;											// The superblock and the group descriptors
+	int *inode_map;
+	inode *inodes;											// The start of the inode block
+	int *freemap;											// The start of the free-map block
+	char *datablks;											// The start of the data_blockss
+
+	io_engine *engine;										// Writes the image back, see io_engine.h
+	void *engine_state;										// This mount's instance of the engine
+	bool dirty[FS_BLKS];									// Image blocks changed since the last persist_fs
+	pthread_mutex_t dirty_lock;								// Guards dirty only, never held across I/O: mark_dirty runs under group and file locks
+	bool flushing[FS_BLKS];									// The dirty blocks persist_fs took, being handed to the engine
+	pthread_mutex_t persist_lock;							// One persist_fs (or engine switch) at a time, guards flushing and the engine
+
+	pthread_mutex_t group_locks[N_GROUPS];					// One per allocation group, guards its maps and counters
+	pthread_rwlock_t file_locks[N_INODES];					// One per inode: writers and truncates of a file's block map and size are exclusive,
+															// so are changes to a directory's entries (lookups and readdir share it)
+
+	pthread_mutex_t xattr_lock;								// Guards attribute areas, shared block refcounts, the index and the cache
+	int xattr_index[XATTR_INDEX_SIZE];						// Shared xattr blocks hashed by content, chained through xattr_chain
+	int xattr_chain[DBLKS];
+	unsigned int xattr_gen[N_INODES];						// Bumped whenever an inode's attributes change
+	xattr_cache_entry xattr_cache[XATTR_CACHE_SIZE];
+};
+
+
+// Helper Functions
+static void close_files(myfs *m);
+static int write_device_headers(myfs *m);
+static int check_devices(myfs *m);
+static void load_devices(myfs *m);
+static void *load_device(void *arg);
+static void queue_run(myfs *m, int b, int end);
+static int initialise_inodes(int* i);
+static int initialise_freemap(int* map);
+static void format_fs(myfs *m);
+static int home_group();
+static int return_first_unused_inode(myfs *m, int group);
+static int return_offset_of_first_free_datablock(myfs *m, int group);
+static int take_datablock(myfs *m, int blk);
+static void release_inode(myfs *m, int ino);
+static void release_datablock(myfs *m, int blk);
+static void release_blocks(myfs *m, int ino);
+static int file_block(myfs *m, int ino, int i);
+static int file_blocks(inode *temp_ino);
+static int alloc_frags(myfs *m, int group, int n, int *slot);
+static void release_frags(myfs *m, int blk, int first, int n);
+static int resize_frags(myfs *m, int ino, int need);
+static int frags_to_block(myfs *m, int ino);
+static int alloc_large(myfs *m, int group, int mask);
+static void make_large(myfs *m, int ino, int chunk, int mask);
+static void grow_large(myfs *m, int ino, off_t offset, off_t end);
+static int truncate_file(myfs *m, int ino, off_t size);
+static int choose_inode_group(myfs *m, int parent, bool dir);
+static void path_to_inode(myfs *m, const char* path, int *ino);
+static int check_inode(myfs *m, int ino);
+static int resolve_parent(myfs *m, const char *path, const char **name);
+static int dir_lookup(myfs *m, int dir, const char *name);
+static void dir_init_block(myfs *m, int blk);
+static int dirent_slack(dirent *temp);
+static void dir_compact(myfs *m, char *blk);
+static int dir_add(myfs *m, int dir, const char *name, int ino);
+static void dir_remove(myfs *m, int dir, const char *name);
+static bool dir_empty(myfs *m, int dir);
+static void dir_changed(myfs *m, int dir);
+static int allocate_inode(myfs *m, int parent, bool dir);
+static int make_entry(myfs *m, int dir, const char *name, bool is_dir);
+static int remove_entry(myfs *m, int dir, const char *name, bool is_dir);
+static void mark_dirty(myfs *m, void *addr, size_t len);
+static void persist_fs(myfs *m);
+static void commit_change(myfs *m);
+static unsigned int xattr_hash(const char *data, int len);
+static xattr_entry *xattr_next(char *area, int len, int *pos);
+static xattr_entry *xattr_find(myfs *m, int ino, const char *name);
+static void xattr_index_add(myfs *m, int blk);
+static void xattr_index_remove(myfs *m, int blk);
+static void xattr_build_index(myfs *m);
+static void xattr_release_block(myfs *m, int blk);
+static int xattr_store(myfs *m, int ino, const char *set, int len);
+static int xattr_update(myfs *m, int ino, const char *name, const char *value, int size, int flags);
+static void xattr_drop(myfs *m, int ino);
+
+
+//-----------------------------------------------------------------------------------------IMAGES---------------------------------------------------------------------------------------
+
+myfs *myfs_mount(const char *image, int flags, int *err)
+{
+	return myfs_mount_striped(image, NULL, 0, 0, flags, err);
+}
+
+
+myfs *myfs_mount_striped(const char *image, const char *const *devices, int n_devices, size_t stripe_unit, int flags, int *err)
+{
+	if(n_devices < 0 || n_devices > MAX_DEVICES || (n_devices > 0 && (stripe_unit == 0 || stripe_unit % BLK_SIZE != 0 || stripe_unit > (size_t)DBLKS * BLK_SIZE)))
+	{
+		*err = -EINVAL;
+		return NULL;
+	}
+
+	myfs *m = calloc(1, sizeof(myfs));
+	m -> flags = flags;
+	m -> engine = &sync_engine;
+	m -> n_devices = n_devices;
+	m -> stripe_blks = n_devices > 0 ? stripe_unit / BLK_SIZE : 0;
+	for(int d = 0; d < MAX_DEVICES; d++)
+	{
+		m -> dev_files[d] = -1;
+	}
+
+	//held for as long as we are mounted, fsck.myfs refuses to repair a mounted image
+	//the data files are locked too, so that two images can't share one
+	int mode = flags & MYFS_READ_ONLY ? O_RDONLY : O_RDWR;
+	m -> fs_file = open(image, mode);
+	*err = m -> fs_file < 0 ? -errno : 0;
+	if(*err == 0 && flock(m -> fs_file, LOCK_EX | LOCK_NB) != 0)
+	{
+		*err = -EBUSY;
+	}
+	for(int d = 0; d < n_devices && *err == 0; d++)
+	{
+		m -> dev_files[d] = open(devices[d], mode);
+		if(m -> dev_files[d] < 0)
+		{
+			*err = -errno;
+		}
+		else if(flock(m -> dev_files[d], LOCK_EX | LOCK_NB) != 0)
+		{
+			*err = -EBUSY;
+		}
+	}
+	if(*err != 0)
+	{
+		close_files(m);
+		free(m);
+		return NULL;
+	}
+
+	struct stat buf;
+	fstat(m -> fs_file, &buf);
+	#ifdef DEBUG
+	printf("%s size = %ld, %d data files\n", image, (long)buf.st_size, n_devices);
+	#endif
+	//block aligned, so that the group descriptors in the superblock each get a cache line of their own
+	m -> fs = aligned_alloc(BLK_SIZE, FS_SIZE);
+	memset(m -> fs, 0, FS_SIZE);
+
+	//a striped image keeps only the metadata in the image file
+	if(buf.st_size != 0)
+	{
+		read(m -> fs_file, m -> fs, n_devices > 0 ? META_BLKS * BLK_SIZE : FS_SIZE);
+	}
+	m -> sb = (superblock *)m -> fs;
+	m -> inode_map = (int *)(m -> fs + SUPER_BLKS * BLK_SIZE);
+	m -> inodes = (inode *)((char *)m -> inode_map + INODE_MAP_BLKS * BLK_SIZE);
+	m -> freemap = (int *)((char *)m -> inodes + INODE_BLKS * BLK_SIZE);
+	m -> datablks = (char *)m -> freemap + FREEMAP_BLKS * BLK_SIZE;
+	pthread_mutex_init(&m -> dirty_lock, NULL);
+	pthread_mutex_init(&m -> persist_lock, NULL);
+	pthread_mutex_init(&m -> xattr_lock, NULL);
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		pthread_mutex_init(&m -> group_locks[g], NULL);
+	}
+	for(int i = 0; i < N_INODES; i++)
+	{
+		pthread_rwlock_init(&m -> file_locks[i], NULL);
+	}
+
+	//only an empty image is formatted, anything else may be someone's data in another layout
+	if(buf.st_size == 0 && !(flags & MYFS_READ_ONLY))
+	{
+		format_fs(m);
+		if(write_device_headers(m) != 0)
+		{
+			*err = -EIO;
+			myfs_unmount(m);
+			return NULL;
+		}
+		persist_fs(m);
+	}
+	else if(m -> sb -> magic != MYFS_MAGIC || m -> sb -> version != MYFS_VERSION)
+	{
+		#ifdef DEBUG
+		printf("%s is not a version %d image\n", image, MYFS_VERSION);
+		#endif
+		*err = -EINVAL;
+		myfs_unmount(m);
+		return NULL;
+	}
+	else if(m -> sb -> n_devices != n_devices || m -> sb -> stripe_blks != m -> stripe_blks)
+	{
+		//formatted for other data files (or none), mounting it would read garbage
+		*err = -EINVAL;
+		myfs_unmount(m);
+		return NULL;
+	}
+	else if(check_devices(m) != 0)
+	{
+		#ifdef DEBUG
+		printf("%s: the data files are not this image's, or not in its order\n", image);
+		#endif
+		*err = -EINVAL;
+		myfs_unmount(m);
+		return NULL;
+	}
+	else if(n_devices > 0)
+	{
+		load_devices(m);
+	}
+
+	xattr_build_index(m);
+	return m;
+}
+
+
+//Switch to another I/O engine, whatever the current one has queued is written out first
+//Falls back to the sync engine (and returns -EIO) if the new one can't be set up
+int myfs_set_engine(myfs *m, const char *name)
+{
+	io_engine *chosen = find_io_engine(name);
+
+	if(chosen == NULL)
+	{
+		return -EINVAL;
+	}
+	if(chosen == m -> engine)
+	{
+		return 0;
+	}
+
+	persist_fs(m);
+	pthread_mutex_lock(&m -> persist_lock);
+	m -> engine -> shutdown(m -> engine_state);
+	m -> engine = &sync_engine;
+	m -> engine_state = NULL;
+	int res = 0;
+	if(chosen -> setup(m -> fs, FS_SIZE, &m -> engine_state) != 0)
+	{
+		res = -EIO;
+	}
+	else
+	{
+		m -> engine = chosen;
+	}
+	pthread_mutex_unlock(&m -> persist_lock);
+	return res;
+}
+
+
+void myfs_sync(myfs *m)
+{
+	persist_fs(m);
+}
+
+
+void myfs_unmount(myfs *m)
+{
+	persist_fs(m);
+	m -> engine -> shutdown(m -> engine_state);
+
+	//closing the image also drops the flock
+	close_files(m);
+	pthread_mutex_destroy(&m -> dirty_lock);
+	pthread_mutex_destroy(&m -> persist_lock);
+	pthread_mutex_destroy(&m -> xattr_lock);
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		pthread_mutex_destroy(&m -> group_locks[g]);
+	}
+	for(int i = 0; i < N_INODES; i++)
+	{
+		pthread_rwlock_destroy(&m -> file_locks[i]);
+	}
+	free(m -> fs);
+	free(m);
+}
+
+
+static void close_files(myfs *m)
+{
+	if(m -> fs_file >= 0)
+	{
+		close(m -> fs_file);
+	}
+	for(int d = 0; d < m -> n_devices; d++)
+	{
+		if(m -> dev_files[d] >= 0)
+		{
+			close(m -> dev_files[d]);
+		}
+	}
+}
+
+
+//Stamp every data file of a freshly formatted image with the image's uuid and the file's place in the order
+static int write_device_headers(myfs *m)
+{
+	char blk[DEVICE_HDR_BLKS * BLK_SIZE] = {0};
+	device_header *hdr = (device_header *)blk;
+
+	hdr -> magic = DEVICE_MAGIC;
+	hdr -> version = MYFS_VERSION;
+	memcpy(hdr -> uuid, m -> sb -> uuid, sizeof(hdr -> uuid));
+	hdr -> n_devices = m -> n_devices;
+	for(int d = 0; d < m -> n_devices; d++)
+	{
+		hdr -> device = d;
+		if(pwrite(m -> dev_files[d], blk, sizeof(blk), 0) != (ssize_t)sizeof(blk))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+//Every data file must carry this image's uuid and sit at the place in the order it was formatted for
+static int check_devices(myfs *m)
+{
+	for(int d = 0; d < m -> n_devices; d++)
+	{
+		device_header hdr;
+		if(pread(m -> dev_files[d], &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)
+			|| hdr.magic != DEVICE_MAGIC || hdr.version != MYFS_VERSION || memcmp(hdr.uuid, m -> sb -> uuid, sizeof(hdr.uuid)) != 0
+			|| hdr.device != d || hdr.n_devices != m -> n_devices)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+//Read the data blocks of a striped image, one thread per data file so the disks work at the same time
+static void load_devices(myfs *m)
+{
+	pthread_t threads[MAX_DEVICES];
+	device_job jobs[MAX_DEVICES];
+
+	for(int d = 0; d < m -> n_devices; d++)
+	{
+		jobs[d].m = m;
+		jobs[d].dev = d;
+		pthread_create(&threads[d], NULL, load_device, &jobs[d]);
+	}
+	for(int d = 0; d < m -> n_devices; d++)
+	{
+		pthread_join(threads[d], NULL);
+	}
+}
+
+
+//Every stripe unit of one data file, in file order
+//Past the end of a data file the blocks were never written and stay zero
+static void *load_device(void *arg)
+{
+	device_job *job = arg;
+	myfs *m = job -> m;
+	int stripe = m -> stripe_blks;
+
+	for(int unit = job -> dev; unit * stripe < DBLKS; unit += m -> n_devices)
+	{
+		int blk = unit * stripe;
+		size_t len = (size_t)(blk + stripe <= DBLKS ? stripe : DBLKS - blk) * BLK_SIZE;
+		off_t offset = STRIPE_OFFSET(blk, m -> n_devices, stripe);
+
+		for(size_t done = 0; done < len; )
+		{
+			ssize_t n = pread(m -> dev_files[job -> dev], m -> datablks + (size_t)blk * BLK_SIZE + done, len - done, offset + done);
+			if(n <= 0)
+			{
+				if(n < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				return NULL;
+			}
+			done += n;
+		}
+	}
+	return NULL;
+}
+
+
+static int initialise_inodes(int* i)
+{
+	// Initalise the inodes
+	// return 0 on success and -1 on some error
+	#ifdef DEBUG
+	printf("Initialising inodes\n");
+	#endif
+
+	for(int x = 0; x < N_INODES; x++)
+	{
+		*i = 0;
+		i ++;
+	}
+	return 0;
+}
+
+
+static int initialise_freemap(int* map)
+{
+	// Initalise the freemap
+	// return 0 on success and -1 on some error
+	#ifdef DEBUG
+	printf("Initialising freemap\n");
+	#endif
+	int x;
+	for(x = 0; x < DBLKS; x++)
+	{
+		*(map + x) = 1;
+	}
+	return 0;
+}
+
+
+//Lay out a fresh image: superblock, group counters, the root directory and the Welcome file
+static void format_fs(myfs *m)
+{
+	superblock *sb = m -> sb;
+
+	mark_dirty(m, m -> fs, FS_SIZE);
+	sb -> magic = MYFS_MAGIC;
+	sb -> version = MYFS_VERSION;
+	sb -> n_groups = N_GROUPS;
+	sb -> inodes_per_group = INODES_PER_GROUP;
+	sb -> blocks_per_group = BLKS_PER_GROUP;
+	sb -> root_inode = ROOT_INODE;
+	sb -> n_devices = m -> n_devices;
+	sb -> stripe_blks = m -> stripe_blks;
+	if(getrandom(sb -> uuid, sizeof(sb -> uuid), 0) != (ssize_t)sizeof(sb -> uuid))
+	{
+		//no entropy to be had, the time and pid still tell images apart
+		int seed[4] = {(int)time(NULL), (int)getpid(), (int)clock(), 0};
+		memcpy(sb -> uuid, seed, sizeof(sb -> uuid));
+	}
+
+	initialise_inodes(m -> inode_map);
+	initialise_freemap(m -> freemap);
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		sb -> groups[g].free_inodes = INODES_PER_GROUP;
+		sb -> groups[g].free_blocks = BLKS_PER_GROUP;
+		sb -> groups[g].n_dirs = 0;
+	}
+
+	// Root takes the first inode and the first block of group 0
+	inode *root_ino = m -> inodes + return_first_unused_inode(m, 0);
+	root_ino -> id = 0;
+	root_ino -> size = 0;
+	memset(root_ino -> data, 0xff, sizeof(root_ino -> data));
+	root_ino -> data[0] = return_offset_of_first_free_datablock(m, 0);
+	root_ino -> frag = -1;
+	root_ino -> n_frags = 0;
+	dir_init_block(m, root_ino -> data[0]);
+	root_ino -> directory = true;
+	root_ino -> link_count = 2;
+	root_ino -> last_accessed = time(NULL);
+	root_ino -> last_modified = time(NULL);
+	sb -> groups[0].n_dirs++;
+
+	// Adding a welcome file to the root_directory
+	int ino = allocate_inode(m, ROOT_INODE, false);
+	inode *temp = m -> inodes + ino;
+	temp -> id = 1;
+	temp -> size = 30;
+	resize_frags(m, ino, 1);
+	strcpy(m -> datablks + (temp -> data[0] * BLK_SIZE) + temp -> frag * FRAG_SIZE, "Welcome To Our File System!!!\n");
+	dir_add(m, ROOT_INODE, "Welcome", ino);
+}
+
+
+//-----------------------------------------------------------------------------------------ALLOCATION---------------------------------------------------------------------------------------
+
+//Group this thread prefers, one per CPU so that parallel creates don't fight over a lock
+static int home_group()
+{
+	int cpu = sched_getcpu();
+	if(cpu < 0)
+	{
+		return 0;
+	}
+	return cpu % N_GROUPS;
+}
+
+
+//free inode function to search the inode bitmap of one allocation group
+static int return_first_unused_inode(myfs *m, int group)
+{
+	superblock *sb = m -> sb;
+	int ix = -1;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	if(sb -> groups[group].free_inodes > 0)
+	{
+		for(int i = group * INODES_PER_GROUP; i < (group + 1) * INODES_PER_GROUP; i++)
+	  	{
+			if(m -> inode_map[i] == 0)
+	    	{
+				m -> inode_map[i] = 1;
+				(m -> inodes + i) -> used = true;
+				sb -> groups[group].free_inodes--;
+				mark_dirty(m, &m -> inode_map[i], sizeof(int));
+				mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+				ix = i;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&m -> group_locks[group]);
+	return ix;
+}
+
+
+//free data block function to search the data bitmap of one allocation group
+static int return_offset_of_first_free_datablock(myfs *m, int group)
+{
+	superblock *sb = m -> sb;
+	int blk = -1;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	if(sb -> groups[group].free_blocks > 0)
+	{
+		for(int i = group * BLKS_PER_GROUP; i < (group + 1) * BLKS_PER_GROUP; i++)
+	  	{
+			if(m -> freemap[i] == 1)
+	    	{
+				m -> freemap[i] = 0; //mark it as used now
+				sb -> groups[group].free_blocks--;
+				mark_dirty(m, &m -> freemap[i], sizeof(int));
+				mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+				blk = i;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&m -> group_locks[group]);
+
+	//a recycled block must not show the previous owner's data (or dirents)
+	if(blk != -1)
+	{
+		memset(m -> datablks + (blk * BLK_SIZE), 0, BLK_SIZE);
+		mark_dirty(m, m -> datablks + (blk * BLK_SIZE), BLK_SIZE);
+	}
+	return blk;
+}
+
+
+static void release_inode(myfs *m, int ino)
+{
+	superblock *sb = m -> sb;
+	int group = ino / INODES_PER_GROUP;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	if((m -> inodes + ino) -> directory)
+	{
+		sb -> groups[group].n_dirs--;
+	}
+	(m -> inodes + ino) -> used = false;
+	m -> inode_map[ino] = 0;
+	sb -> groups[group].free_inodes++;
+	mark_dirty(m, m -> inodes + ino, sizeof(inode));
+	mark_dirty(m, &m -> inode_map[ino], sizeof(int));
+	mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+	pthread_mutex_unlock(&m -> group_locks[group]);
+}
+
+
+static void release_datablock(myfs *m, int blk)
+{
+	superblock *sb = m -> sb;
+	int group = blk / BLKS_PER_GROUP;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	m -> freemap[blk] = 1;
+	sb -> groups[group].free_blocks++;
+	mark_dirty(m, &m -> freemap[blk], sizeof(int));
+	mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+	pthread_mutex_unlock(&m -> group_locks[group]);
+}
+
+
+//Give back every block in the inode's block map (or its fragments)
+static void release_blocks(myfs *m, int ino)
+{
+	inode *temp_ino = m -> inodes + ino;
+
+	if(temp_ino -> frag >= 0)
+	{
+		release_frags(m, temp_ino -> data[0], temp_ino -> frag, temp_ino -> n_frags);
+		temp_ino -> data[0] = NO_BLOCK;
+		temp_ino -> frag = -1;
+		temp_ino -> n_frags = 0;
+	}
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] != NO_BLOCK)
+		{
+			release_datablock(m, temp_ino -> data[i]);
+			temp_ino -> data[i] = NO_BLOCK;
+		}
+	}
+	mark_dirty(m, temp_ino, sizeof(inode));
+}
+
+
+//The block behind the i-th slot of a file's map, allocated (zeroed, in the inode's group if it has room) when the slot is empty
+//Returns -1 when the filesystem is full, the caller holds the file's lock
+static int file_block(myfs *m, int ino, int i)
+{
+	inode *temp_ino = m -> inodes + ino;
+
+	if(temp_ino -> data[i] == NO_BLOCK)
+	{
+		int group = ino / INODES_PER_GROUP;
+		int blk = -1;
+
+		//in line with the other blocks of its stretch if that block is free, so filling a hole keeps a large block whole
+		int goal = -1;
+		for(int j = i - i % LARGE_BLKS; j < i - i % LARGE_BLKS + LARGE_BLKS && goal == -1; j++)
+		{
+			if(temp_ino -> data[j] != NO_BLOCK)
+			{
+				goal = temp_ino -> data[j] - j + i;
+			}
+		}
+		if(goal >= 0 && goal < DBLKS)
+		{
+			blk = take_datablock(m, goal);
+		}
+		for(int g = 0; g < N_GROUPS && blk == -1; g++)
+		{
+			blk = return_offset_of_first_free_datablock(m, (group + g) % N_GROUPS);
+		}
+		if(blk == -1)
+		{
+			return -1;
+		}
+		temp_ino -> data[i] = blk;
+		mark_dirty(m, temp_ino, sizeof(inode));
+	}
+	return temp_ino -> data[i];
+}
+
+
+//Take the block blk if it is free, returns it (zeroed) or -1
+static int take_datablock(myfs *m, int blk)
+{
+	superblock *sb = m -> sb;
+	int group = blk / BLKS_PER_GROUP;
+	bool taken = false;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	if(m -> freemap[blk] == 1)
+	{
+		m -> freemap[blk] = 0;
+		sb -> groups[group].free_blocks--;
+		mark_dirty(m, &m -> freemap[blk], sizeof(int));
+		mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+		taken = true;
+	}
+	pthread_mutex_unlock(&m -> group_locks[group]);
+
+	if(!taken)
+	{
+		return -1;
+	}
+	memset(m -> datablks + (blk * BLK_SIZE), 0, BLK_SIZE);
+	mark_dirty(m, m -> datablks + (blk * BLK_SIZE), BLK_SIZE);
+	return blk;
+}
+
+
+//Whole blocks in the inode's map
+static int file_blocks(inode *temp_ino)
+{
+	int n = 0;
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		n += temp_ino -> data[i] != NO_BLOCK;
+	}
+	return n;
+}
+
+
+//A run of n free slots in one of the group's blocks of fragments, or in a free block that becomes one
+//Partly used blocks come first so that small files pack together
+//Returns the block and sets *slot to the run's first slot, -1 if the group has no room
+static int alloc_frags(myfs *m, int group, int n, int *slot)
+{
+	superblock *sb = m -> sb;
+	int blk = -1, fresh = -1;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	for(int i = group * BLKS_PER_GROUP; i < (group + 1) * BLKS_PER_GROUP && blk == -1; i++)
+	{
+		if(m -> freemap[i] == 1 && fresh == -1)
+		{
+			fresh = i;
+		}
+		if(!(m -> freemap[i] & FRAG_BLOCK))
+		{
+			continue;
+		}
+		for(int s = 0; s + n <= FRAGS_PER_BLK; s++)
+		{
+			if((m -> freemap[i] & FRAG_BITS(n, s)) == 0)
+			{
+				blk = i;
+				*slot = s;
+				break;
+			}
+		}
+	}
+	if(blk == -1 && fresh != -1)
+	{
+		blk = fresh;
+		*slot = 0;
+		m -> freemap[blk] = FRAG_BLOCK;
+		sb -> groups[group].free_blocks--;
+		mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+	}
+	if(blk != -1)
+	{
+		m -> freemap[blk] |= FRAG_BITS(n, *slot);
+		mark_dirty(m, &m -> freemap[blk], sizeof(int));
+	}
+	pthread_mutex_unlock(&m -> group_locks[group]);
+
+	//like whole blocks, recycled slots must not show the previous owner's data
+	if(blk != -1)
+	{
+		char *run = m -> datablks + (blk * BLK_SIZE) + *slot * FRAG_SIZE;
+		memset(run, 0, n * FRAG_SIZE);
+		mark_dirty(m, run, n * FRAG_SIZE);
+	}
+	return blk;
+}
+
+
+//Free n slots from first on, the block itself once none of its slots are used
+static void release_frags(myfs *m, int blk, int first, int n)
+{
+	superblock *sb = m -> sb;
+	int group = blk / BLKS_PER_GROUP;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	m -> freemap[blk] &= ~FRAG_BITS(n, first);
+	if(m -> freemap[blk] == FRAG_BLOCK)
+	{
+		m -> freemap[blk] = 1;
+		sb -> groups[group].free_blocks++;
+		mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+	}
+	mark_dirty(m, &m -> freemap[blk], sizeof(int));
+	pthread_mutex_unlock(&m -> group_locks[group]);
+}
+
+
+//Make the file's run of fragments (possibly none yet) need slots long: in place when the slots after it
+//are free, otherwise in a new run the bytes are copied to. The caller holds the file's lock
+//Returns -1 when no group has room
+static int resize_frags(myfs *m, int ino, int need)
+{
+	inode *temp_ino = m -> inodes + ino;
+	int n = temp_ino -> frag >= 0 ? temp_ino -> n_frags : 0;
+
+	if(need <= n)
+	{
+		return 0;
+	}
+
+	if(n > 0 && temp_ino -> frag + need <= FRAGS_PER_BLK)
+	{
+		int blk = temp_ino -> data[0];
+		int group = blk / BLKS_PER_GROUP;
+		int more = FRAG_BITS(need - n, temp_ino -> frag + n);
+		bool grown = false;
+
+		pthread_mutex_lock(&m -> group_locks[group]);
+		if((m -> freemap[blk] & more) == 0)
+		{
+			m -> freemap[blk] |= more;
+			mark_dirty(m, &m -> freemap[blk], sizeof(int));
+			grown = true;
+		}
+		pthread_mutex_unlock(&m -> group_locks[group]);
+
+		if(grown)
+		{
+			char *added = m -> datablks + (blk * BLK_SIZE) + (temp_ino -> frag + n) * FRAG_SIZE;
+			memset(added, 0, (need - n) * FRAG_SIZE);
+			mark_dirty(m, added, (need - n) * FRAG_SIZE);
+			temp_ino -> n_frags = need;
+			mark_dirty(m, temp_ino, sizeof(inode));
+			return 0;
+		}
+	}
+
+	int group = ino / INODES_PER_GROUP;
+	int slot, blk = -1;
+	for(int g = 0; g < N_GROUPS && blk == -1; g++)
+	{
+		blk = alloc_frags(m, (group + g) % N_GROUPS, need, &slot);
+	}
+	if(blk == -1)
+	{
+		return -1;
+	}
+
+	if(n > 0)
+	{
+		char *run = m -> datablks + (blk * BLK_SIZE) + slot * FRAG_SIZE;
+		memcpy(run, m -> datablks + (temp_ino -> data[0] * BLK_SIZE) + temp_ino -> frag * FRAG_SIZE, n * FRAG_SIZE);
+		release_frags(m, temp_ino -> data[0], temp_ino -> frag, n);
+	}
+	temp_ino -> data[0] = blk;
+	temp_ino -> frag = slot;
+	temp_ino -> n_frags = need;
+	mark_dirty(m, temp_ino, sizeof(inode));
+	return 0;
+}
+
+
+//The file outgrew its fragments: they move to the start of a block of its own
+//Returns -1 (and leaves the file as it was) when there is no free block
+static int frags_to_block(myfs *m, int ino)
+{
+	inode *temp_ino = m -> inodes + ino;
+	int old = temp_ino -> data[0], first = temp_ino -> frag, n = temp_ino -> n_frags;
+
+	temp_ino -> data[0] = NO_BLOCK;
+	temp_ino -> frag = -1;
+	temp_ino -> n_frags = 0;
+	int blk = file_block(m, ino, 0);
+	if(blk == -1)
+	{
+		temp_ino -> data[0] = old;
+		temp_ino -> frag = first;
+		temp_ino -> n_frags = n;
+		return -1;
+	}
+
+	memcpy(m -> datablks + (blk * BLK_SIZE), m -> datablks + (old * BLK_SIZE) + first * FRAG_SIZE, n * FRAG_SIZE);
+	mark_dirty(m, m -> datablks + (blk * BLK_SIZE), n * FRAG_SIZE);
+	release_frags(m, old, first, n);
+	return 0;
+}
+
+
+//The blocks of mask (bit i for the i-th block) of a run of LARGE_BLKS free blocks, aligned to LARGE_BLKS,
+//taken from the group's freemap in one pass. The rest of the run stays free, for the holes between them
+//Returns the first block of the run (the taken ones zeroed), -1 if the group has no such run
+static int alloc_large(myfs *m, int group, int mask)
+{
+	superblock *sb = m -> sb;
+	int first = ROUND_UP_DIV(group * BLKS_PER_GROUP, LARGE_BLKS) * LARGE_BLKS;
+	int base = -1;
+
+	pthread_mutex_lock(&m -> group_locks[group]);
+	for(int b = first; b + LARGE_BLKS <= (group + 1) * BLKS_PER_GROUP && base == -1 && sb -> groups[group].free_blocks >= LARGE_BLKS; b += LARGE_BLKS)
+	{
+		int i = 0;
+		while(i < LARGE_BLKS && m -> freemap[b + i] == 1)
+		{
+			i++;
+		}
+		if(i == LARGE_BLKS)
+		{
+			base = b;
+		}
+	}
+	if(base != -1)
+	{
+		for(int i = 0; i < LARGE_BLKS; i++)
+		{
+			if(mask & (1 << i))
+			{
+				m -> freemap[base + i] = 0;
+				sb -> groups[group].free_blocks--;
+			}
+		}
+		mark_dirty(m, &m -> freemap[base], LARGE_BLKS * sizeof(int));
+		mark_dirty(m, &sb -> groups[group], sizeof(group_desc));
+	}
+	pthread_mutex_unlock(&m -> group_locks[group]);
+
+	for(int i = 0; base != -1 && i < LARGE_BLKS; i++)
+	{
+		if(mask & (1 << i))
+		{
+			memset(m -> datablks + (base + i) * BLK_SIZE, 0, BLK_SIZE);
+			mark_dirty(m, m -> datablks + (base + i) * BLK_SIZE, BLK_SIZE);
+		}
+	}
+	return base;
+}
+
+
+//Move the blocks of the chunk-th LARGE_BLKS stretch of the file's map (and those of mask it has no block for yet)
+//to their places in one large block. Holes elsewhere in the stretch stay holes
+//Left as it is when it already is laid out that way, or when no group has a large block free
+static void make_large(myfs *m, int ino, int chunk, int mask)
+{
+	inode *temp_ino = m -> inodes + ino;
+	int from = chunk * LARGE_BLKS;
+
+	int base = -1;
+	bool in_place = true;
+	for(int i = 0; i < LARGE_BLKS; i++)
+	{
+		int blk = temp_ino -> data[from + i];
+		if(blk == NO_BLOCK)
+		{
+			continue;
+		}
+		mask |= 1 << i;
+		if(base == -1)
+		{
+			base = blk - i;
+		}
+		in_place = in_place && base % LARGE_BLKS == 0 && blk == base + i;
+	}
+	if(base != -1 && in_place)
+	{
+		return;
+	}
+
+	int group = ino / INODES_PER_GROUP;
+	base = -1;
+	for(int g = 0; g < N_GROUPS && base == -1; g++)
+	{
+		base = alloc_large(m, (group + g) % N_GROUPS, mask);
+	}
+	if(base == -1)
+	{
+		return;
+	}
+
+	for(int i = 0; i < LARGE_BLKS; i++)
+	{
+		int old = temp_ino -> data[from + i];
+		if(old != NO_BLOCK)
+		{
+			memcpy(m -> datablks + (base + i) * BLK_SIZE, m -> datablks + old * BLK_SIZE, BLK_SIZE);
+
+			//what the old block holds is garbage once it is free, don't write it back
+			pthread_mutex_lock(&m -> dirty_lock);
+			m -> dirty[META_BLKS + old] = false;
+			pthread_mutex_unlock(&m -> dirty_lock);
+			release_datablock(m, old);
+		}
+		if(mask & (1 << i))
+		{
+			temp_ino -> data[from + i] = base + i;
+		}
+	}
+	mark_dirty(m, temp_ino, sizeof(inode));
+}
+
+
+//A write to offset..end is about to allocate: every LARGE_BLKS stretch of the map it touches that
+//then holds LARGE_THRESHOLD bytes of blocks moves to a large block, so a big file's blocks lie in
+//one run and are written back as one. Blocks written into its holes later go to their place in the run
+static void grow_large(myfs *m, int ino, off_t offset, off_t end)
+{
+	inode *temp_ino = m -> inodes + ino;
+	off_t stretch = (off_t)LARGE_BLKS * BLK_SIZE;
+
+	for(int chunk = offset / stretch; chunk <= (end - 1) / stretch; chunk++)
+	{
+		int blocks = 0, mask = 0;
+		for(int i = 0; i < LARGE_BLKS; i++)
+		{
+			off_t start = (off_t)(chunk * LARGE_BLKS + i) * BLK_SIZE;
+			if(start < end && start + BLK_SIZE > offset)
+			{
+				mask |= 1 << i;
+			}
+			blocks += temp_ino -> data[chunk * LARGE_BLKS + i] != NO_BLOCK || (mask & (1 << i));
+		}
+		if(blocks * BLK_SIZE >= LARGE_THRESHOLD)
+		{
+			make_large(m, ino, chunk, mask);
+		}
+	}
+}
+
+
+//Placement policy for a new inode under parent
+//Files stay in their parent's group so a tree's inodes and blocks sit together,
+//directories go to the group with the most free inodes (fewest directories on a tie),
+//searching from this CPU's home group so that ties spread threads across groups
+//The counters are read without the group locks, they only steer the choice
+static int choose_inode_group(myfs *m, int parent, bool dir)
+{
+	superblock *sb = m -> sb;
+	int home = home_group();
+
+	if(!dir)
+	{
+		int group = parent / INODES_PER_GROUP;
+		if(sb -> groups[group].free_inodes > 0 && sb -> groups[group].free_blocks > 0)
+		{
+			return group;
+		}
+		return home;
+	}
+
+	int best = home;
+	for(int i = 0; i < N_GROUPS; i++)
+	{
+		int g = (home + i) % N_GROUPS;
+		group_desc *cur = &sb -> groups[g];
+		group_desc *b = &sb -> groups[best];
+
+		if(cur -> free_blocks == 0)
+		{
+			continue;
+		}
+		if(cur -> free_inodes > b -> free_inodes || (cur -> free_inodes == b -> free_inodes && cur -> n_dirs < b -> n_dirs))
+		{
+			best = g;
+		}
+	}
+	return best;
+}
+
+
+//Allocates an inode for a new entry under parent, and the first block of a directory
+//Files start without blocks, myfs_write allocates them as they are written
+//Returns the inode number, or -1 when the filesystem is full
+static int allocate_inode(myfs *m, int parent, bool dir)
+{
+	int first = choose_inode_group(m, parent, dir);
+	int ino = -1;
+
+	//preferred group first, then the others in order
+	for(int i = 0; i < N_GROUPS && ino == -1; i++)
+	{
+		ino = return_first_unused_inode(m, (first + i) % N_GROUPS);
+	}
+	if(ino == -1)
+	{
+		return -1;
+	}
+
+	//data lives in the inode's group whenever there is room
+	int group = ino / INODES_PER_GROUP;
+	int blk = NO_BLOCK;
+	for(int i = 0; dir && i < N_GROUPS && blk == NO_BLOCK; i++)
+	{
+		blk = return_offset_of_first_free_datablock(m, (group + i) % N_GROUPS);
+	}
+	if(dir && blk == NO_BLOCK)
+	{
+		release_inode(m, ino);
+		return -1;
+	}
+
+	#ifdef DEBUG
+	printf("ALLOCATING INODE\n");
+	printf("inode %d in group %d, block %d\n", ino, group, blk);
+	#endif
+
+	//position the pointer to correct address
+	inode *temp_ino = m -> inodes + ino;
+
+	temp_ino -> id = rand() % 5000;
+	temp_ino -> size = 0;
+	memset(temp_ino -> data, 0xff, sizeof(temp_ino -> data));
+	temp_ino -> data[0] = blk;
+	temp_ino -> frag = -1;
+	temp_ino -> n_frags = 0;
+	temp_ino -> directory = dir;
+	temp_ino -> last_accessed = time(NULL);
+	temp_ino -> last_modified = time(NULL);
+	temp_ino -> xattr_blk = 0;
+	memset(temp_ino -> xattr_inline, 0, XATTR_INLINE_SIZE);
+	mark_dirty(m, temp_ino, sizeof(inode));
+
+  	if(dir)
+  	{
+    	dir_init_block(m, blk);
+    	temp_ino -> link_count = 2;
+    	pthread_mutex_lock(&m -> group_locks[group]);
+    	m -> sb -> groups[group].n_dirs++;
+    	mark_dirty(m, &m -> sb -> groups[group], sizeof(group_desc));
+    	pthread_mutex_unlock(&m -> group_locks[group]);
+  	}
+  	else
+  	{
+    	temp_ino -> link_count = 1;
+  	}
+  	return ino;
+}
+
+
+//-----------------------------------------------------------------------------------------NAMES---------------------------------------------------------------------------------------
+
+//Parse the path to reach the correct inode using the directory entries
+static void path_to_inode(myfs *m, const char* path, int *ino)
+{
+	// Given the path name it will return the inode number if it exists else it returns -1
+	#ifdef DEBUG
+	printf("path_to_inode - path - %s\n", path);
+	#endif
+
+	*ino = ROOT_INODE;
+
+  	//work on a copy, strtok must not scribble over the caller's path
+  	char *path_copy = strdup(path);
+  	char *saveptr;
+  	char *token = strtok_r(path_copy, "/", &saveptr);
+
+  	while (token != NULL)
+  	{
+  		//only directories can have something below them
+  		if(!(m -> inodes + *ino) -> directory)
+  		{
+  			*ino = -1;
+  			break;
+  		}
+
+  		int dir = *ino;
+  		pthread_rwlock_rdlock(&m -> file_locks[dir]);
+  		*ino = dir_lookup(m, dir, token);
+  		pthread_rwlock_unlock(&m -> file_locks[dir]);
+  		if(*ino == -1)
+    	{
+  			#ifdef DEBUG
+  			printf("Inode doesnt exist!! for the path %s\n", path);
+  			#endif
+  			break;
+  		}
+  		token = strtok_r(NULL, "/", &saveptr);
+  	}
+  	free(path_copy);
+}
+
+
+//0 if ino is an inode in use, callers of the library can pass anything
+static int check_inode(myfs *m, int ino)
+{
+	if(ino < 0 || ino >= N_INODES || m -> inode_map[ino] == 0)
+	{
+		return -ENOENT;
+	}
+	return 0;
+}
+
+
+//Inode number of the directory holding path, *name is set to the last component
+static int resolve_parent(myfs *m, const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+
+	if(slash == NULL || slash[1] == '\0')
+	{
+		return -EINVAL;
+	}
+	*name = slash + 1;
+
+	//"/a/b" -> "/a", "/a" -> "/"
+	char *parent = strndup(path, slash == path ? 1 : slash - path);
+	int dir = myfs_lookup(m, parent);
+	free(parent);
+	return dir;
+}
+
+
+int myfs_lookup(myfs *m, const char *path)
+{
+	int ino;
+	path_to_inode(m, path, &ino);
+	return ino == -1 ? -ENOENT : ino;
+}
+
+
+int myfs_lookupat(myfs *m, int dir, const char *name)
+{
+	int res = check_inode(m, dir);
+	if(res != 0)
+	{
+		return res;
+	}
+	if(!(m -> inodes + dir) -> directory)
+	{
+		return -ENOTDIR;
+	}
+
+	pthread_rwlock_rdlock(&m -> file_locks[dir]);
+	int ino = dir_lookup(m, dir, name);
+	pthread_rwlock_unlock(&m -> file_locks[dir]);
+	return ino == -1 ? -ENOENT : ino;
+}
+
+
+int myfs_open(myfs *m, const char *path, int flags)
+{
+	int ino = myfs_lookup(m, path);
+
+	if(ino == -ENOENT && (flags & O_CREAT))
+	{
+		return myfs_create(m, path);
+	}
+	if(ino < 0)
+	{
+		return ino;
+	}
+	if((flags & O_CREAT) && (flags & O_EXCL))
+	{
+		return -EEXIST;
+	}
+	if((m -> inodes + ino) -> directory && (flags & O_ACCMODE) != O_RDONLY)
+	{
+		return -EISDIR;
+	}
+	if((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+	{
+		int res = myfs_truncate(m, ino, 0);
+		if(res != 0)
+		{
+			return res;
+		}
+	}
+	return ino;
+}
+
+
+int myfs_readdir(myfs *m, int dir, myfs_filldir fill, void *arg)
+{
+	int res = check_inode(m, dir);
+	if(res != 0)
+	{
+		return res;
+	}
+	if(!(m -> inodes + dir) -> directory)
+	{
+		return -ENOTDIR;
+	}
+
+	inode *temp_ino = m -> inodes + dir;
+	char name[MYFS_NAME_MAX + 1];
+
+    //read all files/entries in the DIR block by block, skipping free records
+	pthread_rwlock_rdlock(&m -> file_locks[dir]);
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] == NO_BLOCK)
+		{
+			continue;
+		}
+
+		char *blk = m -> datablks + temp_ino -> data[i] * BLK_SIZE;
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			dirent *temp = (dirent *)pos;
+			if(temp -> name_len == 0)
+			{
+				continue;
+			}
+
+			memcpy(name, temp -> name, temp -> name_len);
+			name[temp -> name_len] = '\0';
+			if(fill(arg, name, temp -> file_inode, temp -> type == FT_DIR) != 0)
+			{
+				pthread_rwlock_unlock(&m -> file_locks[dir]);
+				return 0;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&m -> file_locks[dir]);
+  	return 0;
+}
+
+
+//Find name in the directory with inode number dir, returns its inode number or -1
+//The caller holds the directory's lock, shared at least
+static int dir_lookup(myfs *m, int dir, const char *name)
+{
+	inode *temp_ino = m -> inodes + dir;
+	int name_len = strlen(name);
+
+	if(name_len == 0 || name_len > MYFS_NAME_MAX)
+	{
+		return -1;
+	}
+
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] == NO_BLOCK)
+		{
+			continue;
+		}
+
+		char *blk = m -> datablks + temp_ino -> data[i] * BLK_SIZE;
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			dirent *temp = (dirent *)pos;
+			if(temp -> name_len == name_len && memcmp(temp -> name, name, name_len) == 0)
+			{
+				return temp -> file_inode;
+			}
+		}
+	}
+	return -1;
+}
+
+
+//A fresh directory block: one free record spanning all of it
+static void dir_init_block(myfs *m, int blk)
+{
+	dirent *temp = (dirent *)(m -> datablks + blk * BLK_SIZE);
+
+	temp -> file_inode = 0;
+	temp -> rec_len = BLK_SIZE;
+	temp -> name_len = 0;
+	temp -> type = 0;
+	mark_dirty(m, temp, DIRENT_HDR_SIZE);
+}
+
+
+//Bytes of a record not taken by its own entry
+static int dirent_slack(dirent *temp)
+{
+	return temp -> rec_len - (temp -> name_len ? DIRENT_LEN(temp -> name_len) : 0);
+}
+
+
+//Slide the live records of a block to its start so that all its free space ends up in the last one
+//Under the directory's exclusive lock (from dir_add), lookups would trip over half-moved records
+static void dir_compact(myfs *m, char *blk)
+{
+	char *out = blk;
+	dirent *last = NULL;
+
+	for(char *pos = blk; pos < blk + BLK_SIZE; )
+	{
+		dirent *temp = (dirent *)pos;
+		int rec_len = temp -> rec_len;
+
+		if(temp -> name_len != 0)
+		{
+			int len = DIRENT_LEN(temp -> name_len);
+			memmove(out, pos, len);
+			last = (dirent *)out;
+			last -> rec_len = len;
+			out += len;
+		}
+		pos += rec_len;
+	}
+
+	if(last == NULL)
+	{
+		dir_init_block(m, (blk - m -> datablks) / BLK_SIZE);
+		return;
+	}
+	last -> rec_len += blk + BLK_SIZE - out;
+	mark_dirty(m, blk, BLK_SIZE);
+}
+
+
+//Add name -> ino to the directory dir: into the first block with room for the record
+//(compacting it if its room is scattered between records), growing the directory by a block if none has any
+//A name holding a '/', or "." or "..", could never be looked up again and gives -EINVAL
+//The caller holds the directory's lock exclusive
+static int dir_add(myfs *m, int dir, const char *name, int ino)
+{
+	inode *temp_ino = m -> inodes + dir;
+	int name_len = strlen(name);
+	int need = DIRENT_LEN(name_len);
+	int target = -1, hole = -1;
+
+	if(name_len > MYFS_NAME_MAX)
+	{
+		return -ENAMETOOLONG;
+	}
+	if(name_len == 0 || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	{
+		return -EINVAL;
+	}
+
+	//the whole directory is scanned for the name before anything is added
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] == NO_BLOCK)
+		{
+			if(hole == -1)
+			{
+				hole = i;
+			}
+			continue;
+		}
+
+		char *blk = m -> datablks + temp_ino -> data[i] * BLK_SIZE;
+		int room = 0;
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			dirent *temp = (dirent *)pos;
+			if(temp -> name_len == name_len && memcmp(temp -> name, name, name_len) == 0)
+			{
+				return -EEXIST;
+			}
+			room += dirent_slack(temp);
+		}
+		if(target == -1 && room >= need)
+		{
+			target = i;
+		}
+	}
+
+	if(target == -1)
+	{
+		if(hole == -1)
+		{
+			return -ENOSPC;
+		}
+
+		//next to the directory's other blocks whenever there is room
+		int group = dir / INODES_PER_GROUP;
+		int blk = -1;
+		for(int i = 0; i < N_GROUPS && blk == -1; i++)
+		{
+			blk = return_offset_of_first_free_datablock(m, (group + i) % N_GROUPS);
+		}
+		if(blk == -1)
+		{
+			return -ENOSPC;
+		}
+		dir_init_block(m, blk);
+		temp_ino -> data[hole] = blk;
+		mark_dirty(m, temp_ino, sizeof(inode));
+		target = hole;
+	}
+
+	char *blk = m -> datablks + temp_ino -> data[target] * BLK_SIZE;
+	dirent *slot = NULL;
+	for(int pass = 0; pass < 2 && slot == NULL; pass++)
+	{
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			if(dirent_slack((dirent *)pos) >= need)
+			{
+				slot = (dirent *)pos;
+				break;
+			}
+		}
+		if(slot == NULL)
+		{
+			dir_compact(m, blk);
+		}
+	}
+
+	//a live record gives up the room after its name, a free one is taken over whole
+	if(slot -> name_len != 0)
+	{
+		dirent *prev = slot;
+		int len = DIRENT_LEN(prev -> name_len);
+		slot = (dirent *)((char *)prev + len);
+		slot -> rec_len = prev -> rec_len - len;
+		prev -> rec_len = len;
+		mark_dirty(m, prev, DIRENT_HDR_SIZE);
+	}
+	slot -> file_inode = ino;
+	slot -> name_len = name_len;
+	slot -> type = (m -> inodes + ino) -> directory ? FT_DIR : FT_REG;
+	memcpy(slot -> name, name, name_len);
+	mark_dirty(m, slot, DIRENT_LEN(name_len));
+	return 0;
+}
+
+
+//Drop the entry for name from dir: its record is merged into the one before it,
+//a block left without entries (other than the first) goes back to the allocator
+//The caller holds the directory's lock exclusive
+static void dir_remove(myfs *m, int dir, const char *name)
+{
+	inode *temp_ino = m -> inodes + dir;
+	int name_len = strlen(name);
+
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] == NO_BLOCK)
+		{
+			continue;
+		}
+
+		char *blk = m -> datablks + temp_ino -> data[i] * BLK_SIZE;
+		dirent *prev = NULL;
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			dirent *temp = (dirent *)pos;
+			if(temp -> name_len != name_len || memcmp(temp -> name, name, name_len) != 0)
+			{
+				prev = temp;
+				continue;
+			}
+
+			if(prev != NULL)
+			{
+				prev -> rec_len += temp -> rec_len;
+				mark_dirty(m, prev, DIRENT_HDR_SIZE);
+			}
+			else
+			{
+				temp -> file_inode = 0;
+				temp -> name_len = 0;
+				mark_dirty(m, temp, DIRENT_HDR_SIZE);
+			}
+
+			dirent *first = (dirent *)blk;
+			if(i > 0 && first -> name_len == 0 && first -> rec_len == BLK_SIZE)
+			{
+				release_datablock(m, temp_ino -> data[i]);
+				temp_ino -> data[i] = NO_BLOCK;
+				mark_dirty(m, temp_ino, sizeof(inode));
+			}
+			return;
+		}
+	}
+}
+
+
+static bool dir_empty(myfs *m, int dir)
+{
+	inode *temp_ino = m -> inodes + dir;
+
+	for(int i = 0; i < DBLKS_PER_INODE; i++)
+	{
+		if(temp_ino -> data[i] == NO_BLOCK)
+		{
+			continue;
+		}
+
+		char *blk = m -> datablks + temp_ino -> data[i] * BLK_SIZE;
+		for(char *pos = blk; pos < blk + BLK_SIZE; pos += ((dirent *)pos) -> rec_len)
+		{
+			if(((dirent *)pos) -> name_len != 0)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+//Bump the mtime of a directory whose entries changed
+static void dir_changed(myfs *m, int dir)
+{
+	inode *temp_ino = m -> inodes + dir;
+	temp_ino -> last_modified = time(NULL);
+	mark_dirty(m, temp_ino, sizeof(inode));
+}
+
+
+//Create a file or directory called name in dir, returns its inode number
+static int make_entry(myfs *m, int dir, const char *name, bool is_dir)
+{
+	int res = check_inode(m, dir);
+	if(res != 0)
+	{
+		return res;
+	}
+	if(!(m -> inodes + dir) -> directory)
+	{
+		return -ENOTDIR;
+	}
+
+    //Finds a free inode (next to its parent for files) and initializes it
+  	int ino = allocate_inode(m, dir, is_dir);
+  	if(ino == -1)
+  	{
+  		return -ENOSPC;
+  	}
+
+  	pthread_rwlock_wrlock(&m -> file_locks[dir]);
+  	res = dir_add(m, dir, name, ino);
+  	if(res == 0)
+  	{
+  		dir_changed(m, dir);
+  	}
+  	pthread_rwlock_unlock(&m -> file_locks[dir]);
+  	if(res != 0)
+  	{
+  		release_blocks(m, ino);
+  		release_inode(m, ino);
+  		return res;
+  	}
+  	commit_change(m);
+  	return ino;
+}
+
+
+//Remove the file or (empty) directory called name from dir
+//Both locks are held exclusive throughout, parent first: nothing is created in a directory
+//found empty, and nobody is left reading the entry or writing the inode's blocks
+static int remove_entry(myfs *m, int dir, const char *name, bool is_dir)
+{
+	int res = check_inode(m, dir);
+	if(res != 0)
+	{
+		return res;
+	}
+	if(!(m -> inodes + dir) -> directory)
+	{
+		return -ENOTDIR;
+	}
+
+	pthread_rwlock_wrlock(&m -> file_locks[dir]);
+	int ino = dir_lookup(m, dir, name);
+	if(ino == -1)
+	{
+		pthread_rwlock_unlock(&m -> file_locks[dir]);
+		return -ENOENT;
+	}
+	if(is_dir != (m -> inodes + ino) -> directory)
+	{
+		pthread_rwlock_unlock(&m -> file_locks[dir]);
+		return is_dir ? -ENOTDIR : -EISDIR;
+	}
+
+	pthread_rwlock_wrlock(&m -> file_locks[ino]);
+    //directory has stuff
+	if(is_dir && !dir_empty(m, ino))
+	{
+		#ifdef DEBUG
+		printf("Directory isnt empty!!\n");
+		#endif
+
+		pthread_rwlock_unlock(&m -> file_locks[ino]);
+		pthread_rwlock_unlock(&m -> file_locks[dir]);
+		return -ENOTEMPTY;
+	}
+
+  	//drop the entry, then give the inode and its data block back to their groups
+	dir_remove(m, dir, name);
+	xattr_drop(m, ino);
+	release_blocks(m, ino);
+	release_inode(m, ino);
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+
+	dir_changed(m, dir);
+	pthread_rwlock_unlock(&m -> file_locks[dir]);
+	commit_change(m);
+	return 0;
+}
+
+
+int myfs_createat(myfs *m, int dir, const char *name)
+{
+	return make_entry(m, dir, name, false);
+}
+
+
+int myfs_mkdirat(myfs *m, int dir, const char *name)
+{
+	return make_entry(m, dir, name, true);
+}
+
+
+int myfs_unlinkat(myfs *m, int dir, const char *name)
+{
+	return remove_entry(m, dir, name, false);
+}
+
+
+int myfs_rmdirat(myfs *m, int dir, const char *name)
+{
+	return remove_entry(m, dir, name, true);
+}
+
+
+int myfs_create(myfs *m, const char *path)
+{
+	const char *name;
+	int dir = resolve_parent(m, path, &name);
+	return dir < 0 ? dir : myfs_createat(m, dir, name);
+}
+
+
+int myfs_mkdir(myfs *m, const char *path)
+{
+	const char *name;
+	int dir = resolve_parent(m, path, &name);
+	return dir < 0 ? dir : myfs_mkdirat(m, dir, name);
+}
+
+
+int myfs_unlink(myfs *m, const char *path)
+{
+	const char *name;
+	int dir = resolve_parent(m, path, &name);
+	return dir < 0 ? dir : myfs_unlinkat(m, dir, name);
+}
+
+
+int myfs_rmdir(myfs *m, const char *path)
+{
+	const char *name;
+	int dir = resolve_parent(m, path, &name);
+	return dir < 0 ? dir : myfs_rmdirat(m, dir, name);
+}
+
+
+//-----------------------------------------------------------------------------------------INODES---------------------------------------------------------------------------------------
+
+int myfs_stat(myfs *m, int ino, struct stat *st)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+    //buffer to get the attributes
+  	memset(st, 0, sizeof(struct stat));
+
+  	inode *temp_ino = m -> inodes + ino;
+  	st->st_ino = ino;
+  	if (temp_ino -> directory)
+    {
+  		st->st_mode = S_IFDIR | 0777;
+  		st->st_nlink = 2;
+  	}
+
+  	else
+    {
+  		st->st_mode = S_IFREG | 0444;
+  		st->st_nlink = 1;
+  		st->st_size = temp_ino -> size;
+  		//only the blocks (or fragments) the file has, holes take no space
+  		if(temp_ino -> frag >= 0)
+  		{
+  			st->st_blocks = temp_ino -> n_frags * (FRAG_SIZE / 512);
+  		}
+  		else
+  		{
+  			st->st_blocks = file_blocks(temp_ino) * (BLK_SIZE / 512);
+  		}
+  	}
+
+  	st->st_atime = temp_ino -> last_accessed;
+  	st->st_mtime = temp_ino -> last_modified;
+  	st->st_ctime = temp_ino -> last_modified;
+  	return 0;
+}
+
+
+int myfs_statfs(myfs *m, struct statvfs *st)
+{
+	superblock *sb = m -> sb;
+
+	memset(st, 0, sizeof(struct statvfs));
+	st -> f_bsize = BLK_SIZE;
+	st -> f_frsize = FRAG_SIZE;
+	st -> f_blocks = (fsblkcnt_t)DBLKS * FRAGS_PER_BLK;
+	st -> f_files = N_INODES;
+	st -> f_namemax = MYFS_NAME_MAX;
+
+	for(int g = 0; g < N_GROUPS; g++)
+	{
+		pthread_mutex_lock(&m -> group_locks[g]);
+		st -> f_bfree += (fsblkcnt_t)sb -> groups[g].free_blocks * FRAGS_PER_BLK;
+		st -> f_ffree += sb -> groups[g].free_inodes;
+		for(int i = g * BLKS_PER_GROUP; i < (g + 1) * BLKS_PER_GROUP; i++)
+		{
+			if(m -> freemap[i] & FRAG_BLOCK)
+			{
+				st -> f_bfree += FRAGS_PER_BLK - __builtin_popcount(m -> freemap[i] & 0xff);
+			}
+		}
+		pthread_mutex_unlock(&m -> group_locks[g]);
+	}
+	st -> f_bavail = st -> f_bfree;
+	st -> f_favail = st -> f_ffree;
+	return 0;
+}
+
+
+int myfs_read(myfs *m, int ino, char *buf, size_t size, off_t offset)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	if(temp_ino -> directory)
+	{
+		return -EISDIR;
+	}
+	if(offset < 0)
+	{
+		return -EINVAL;
+	}
+
+	pthread_rwlock_rdlock(&m -> file_locks[ino]);
+	size_t len = temp_ino->size;
+
+	if (offset < (off_t)len)
+	{
+		if (offset + size > len)
+			size = len - offset;
+
+		//a small file's bytes are its fragments, anything after them reads as zeros
+		size_t in_frags = 0;
+		if(temp_ino -> frag >= 0)
+		{
+			off_t have = temp_ino -> n_frags * FRAG_SIZE;
+			if(offset < have)
+			{
+				in_frags = have - offset < (off_t)size ? have - offset : size;
+				memcpy(buf, m -> datablks + (temp_ino -> data[0] * BLK_SIZE) + temp_ino -> frag * FRAG_SIZE + offset, in_frags);
+			}
+			memset(buf + in_frags, 0, size - in_frags);
+		}
+
+		//block by block, a slot without a block (a range never written) reads as zeros
+		for(size_t done = 0; temp_ino -> frag < 0 && done < size; )
+		{
+			off_t pos = offset + done;
+			int blk = temp_ino -> data[pos / BLK_SIZE];
+			size_t n = BLK_SIZE - pos % BLK_SIZE;
+			if(n > size - done)
+			{
+				n = size - done;
+			}
+
+			if(blk == NO_BLOCK)
+			{
+				memset(buf + done, 0, n);
+			}
+			else
+			{
+				memcpy(buf + done, m -> datablks + (blk * BLK_SIZE) + pos % BLK_SIZE, n);
+			}
+			done += n;
+		}
+		temp_ino -> last_accessed = time(NULL); // persisted along with the next change
+		mark_dirty(m, temp_ino, sizeof(inode));
+	}
+
+	else
+		size = 0;
+
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+	return size;
+}
+
+
+//Writes at any offset, allocating blocks for the slots the range touches
+//Writes may arrive out of order and in parallel (the kernel's writeback flushes pages as it likes),
+//the file only grows to the furthest byte written
+//A file whose bytes all lie below FRAG_MAX lives in fragments, past that it moves to blocks
+//and stretches of the map that fill up become large blocks (see grow_large)
+//Returns the bytes written, short when the range runs past MAX_FILE_SIZE or the filesystem fills up
+int myfs_write(myfs *m, int ino, const char *buf, size_t size, off_t offset)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	if(temp_ino -> directory)
+	{
+		return -EISDIR;
+	}
+	if(offset < 0)
+	{
+		return -EINVAL;
+	}
+	if(size == 0)
+	{
+		return 0;
+	}
+	if(offset >= MAX_FILE_SIZE)
+	{
+		return -EFBIG;
+	}
+	if(offset + size > MAX_FILE_SIZE)
+	{
+		size = MAX_FILE_SIZE - offset;
+	}
+
+	pthread_rwlock_wrlock(&m -> file_locks[ino]);
+	size_t done = 0;
+	off_t end = offset + size;
+	if(end <= FRAG_MAX && (temp_ino -> frag >= 0 || file_blocks(temp_ino) == 0))
+	{
+		if(resize_frags(m, ino, ROUND_UP_DIV(end, FRAG_SIZE)) == 0)
+		{
+			char *temp_data = m -> datablks + (temp_ino -> data[0] * BLK_SIZE) + temp_ino -> frag * FRAG_SIZE + offset;
+			memcpy(temp_data, buf, size);
+			mark_dirty(m, temp_data, size);
+			done = size;
+		}
+	}
+	else if(temp_ino -> frag < 0 || frags_to_block(m, ino) == 0)
+	{
+		grow_large(m, ino, offset, end);
+	}
+	while(temp_ino -> frag < 0 && done < size)
+	{
+		off_t pos = offset + done;
+		int blk = file_block(m, ino, pos / BLK_SIZE);
+		if(blk == -1)
+		{
+			break;
+		}
+
+		size_t n = BLK_SIZE - pos % BLK_SIZE;
+		if(n > size - done)
+		{
+			n = size - done;
+		}
+		char *temp_data = m -> datablks + (blk * BLK_SIZE) + pos % BLK_SIZE;
+		memcpy(temp_data, buf + done, n);
+		mark_dirty(m, temp_data, n);
+		done += n;
+	}
+
+	if(done > 0)
+	{
+		if(offset + done > temp_ino -> size)
+		{
+			temp_ino -> size = offset + done;
+		}
+		temp_ino -> last_modified = time(NULL);
+		mark_dirty(m, temp_ino, sizeof(inode));
+	}
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+
+	if(done == 0)
+	{
+		return -ENOSPC;
+	}
+	commit_change(m);
+	return done;
+}
+
+
+//Cut or extend a file to size bytes, the caller holds the file's lock
+//Blocks wholly past the new end go back to the freemap and the rest of the last one is zeroed,
+//so a file grown again later reads zeros there rather than the old bytes
+static int truncate_file(myfs *m, int ino, off_t size)
+{
+	inode *temp_ino = m -> inodes + ino;
+
+	if(size < 0)
+	{
+		return -EINVAL;
+	}
+	if(size > MAX_FILE_SIZE)
+	{
+		return -EFBIG;
+	}
+
+	if((size_t)size < temp_ino -> size && temp_ino -> frag >= 0)
+	{
+		int keep = ROUND_UP_DIV(size, FRAG_SIZE);
+		if(keep < temp_ino -> n_frags)
+		{
+			release_frags(m, temp_ino -> data[0], temp_ino -> frag + keep, temp_ino -> n_frags - keep);
+			temp_ino -> n_frags = keep;
+		}
+		if(keep == 0)
+		{
+			temp_ino -> data[0] = NO_BLOCK;
+			temp_ino -> frag = -1;
+		}
+		else if(size < temp_ino -> n_frags * FRAG_SIZE)
+		{
+			//only the run is the file's, past it (a file grown by truncate) other files' slots follow
+			char *tail = m -> datablks + (temp_ino -> data[0] * BLK_SIZE) + temp_ino -> frag * FRAG_SIZE + size;
+			memset(tail, 0, temp_ino -> n_frags * FRAG_SIZE - size);
+			mark_dirty(m, tail, temp_ino -> n_frags * FRAG_SIZE - size);
+		}
+	}
+	else if((size_t)size < temp_ino -> size)
+	{
+		for(int i = ROUND_UP_DIV(size, BLK_SIZE); i < DBLKS_PER_INODE; i++)
+		{
+			if(temp_ino -> data[i] != NO_BLOCK)
+			{
+				release_datablock(m, temp_ino -> data[i]);
+				temp_ino -> data[i] = NO_BLOCK;
+			}
+		}
+
+		int last = temp_ino -> data[size / BLK_SIZE];
+		if(size % BLK_SIZE != 0 && last != NO_BLOCK)
+		{
+			char *tail = m -> datablks + (last * BLK_SIZE) + size % BLK_SIZE;
+			memset(tail, 0, BLK_SIZE - size % BLK_SIZE);
+			mark_dirty(m, tail, BLK_SIZE - size % BLK_SIZE);
+		}
+	}
+
+	temp_ino -> size = size;
+	temp_ino -> last_modified = time(NULL);
+	mark_dirty(m, temp_ino, sizeof(inode));
+	return 0;
+}
+
+
+//Allocate the range as writing it would (fragments, blocks, large blocks) without writing anything,
+//the file grows to its end like with posix_fallocate. Returns -ENOSPC if the filesystem fills up on the way
+//(what was allocated by then stays), myfs-pack reserves every file this way while it walks the tree
+int myfs_fallocate(myfs *m, int ino, off_t offset, off_t len)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	if(temp_ino -> directory)
+	{
+		return -EISDIR;
+	}
+	if(offset < 0 || len <= 0)
+	{
+		return -EINVAL;
+	}
+	if(offset + len > MAX_FILE_SIZE)
+	{
+		return -EFBIG;
+	}
+
+	pthread_rwlock_wrlock(&m -> file_locks[ino]);
+	off_t end = offset + len;
+	if(end <= FRAG_MAX && (temp_ino -> frag >= 0 || file_blocks(temp_ino) == 0))
+	{
+		res = resize_frags(m, ino, ROUND_UP_DIV(end, FRAG_SIZE)) == 0 ? 0 : -ENOSPC;
+	}
+	else if(temp_ino -> frag >= 0 && frags_to_block(m, ino) != 0)
+	{
+		res = -ENOSPC;
+	}
+	else
+	{
+		grow_large(m, ino, offset, end);
+		for(int i = offset / BLK_SIZE; i <= (end - 1) / BLK_SIZE && res == 0; i++)
+		{
+			res = file_block(m, ino, i) == -1 ? -ENOSPC : 0;
+		}
+	}
+
+	if(res == 0 && (size_t)end > temp_ino -> size)
+	{
+		temp_ino -> size = end;
+		temp_ino -> last_modified = time(NULL);
+		mark_dirty(m, temp_ino, sizeof(inode));
+	}
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+	commit_change(m);
+	return res;
+}
+
+
+int myfs_truncate(myfs *m, int ino, off_t size)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+	if((m -> inodes + ino) -> directory)
+	{
+		return -EISDIR;
+	}
+
+	pthread_rwlock_wrlock(&m -> file_locks[ino]);
+	res = truncate_file(m, ino, size);
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+
+	if(res == 0)
+	{
+		commit_change(m);
+	}
+	return res;
+}
+
+
+//SEEK_DATA / SEEK_HOLE as lseek(2) answers them, at block granularity: an empty slot of the map is a hole,
+//and so is everything from the end of the file on
+//Other whences are left to the caller, they don't depend on the block map
+off_t myfs_lseek(myfs *m, int ino, off_t offset, int whence)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	if(temp_ino -> directory)
+	{
+		return -EISDIR;
+	}
+	if(whence != SEEK_DATA && whence != SEEK_HOLE)
+	{
+		return -EINVAL;
+	}
+	if(offset < 0)
+	{
+		return -ENXIO;
+	}
+
+	pthread_rwlock_rdlock(&m -> file_locks[ino]);
+	off_t size = temp_ino -> size;
+	off_t pos = -ENXIO;
+	if(offset < size)
+	{
+		pos = size;
+		for(int i = offset / BLK_SIZE; (off_t)i * BLK_SIZE < size; i++)
+		{
+			if((temp_ino -> data[i] != NO_BLOCK) == (whence == SEEK_DATA))
+			{
+				pos = (off_t)i * BLK_SIZE > offset ? (off_t)i * BLK_SIZE : offset;
+				break;
+			}
+		}
+		//no data past offset
+		if(whence == SEEK_DATA && pos == size)
+		{
+			pos = -ENXIO;
+		}
+	}
+	pthread_rwlock_unlock(&m -> file_locks[ino]);
+	return pos;
+}
+
+
+//Set the access and modification times as utimensat(2) does: NULL means now, UTIME_NOW and UTIME_OMIT per field
+//In writeback mode the kernel keeps mtime itself and pushes it back through here
+int myfs_utimens(myfs *m, int ino, const struct timespec tv[2])
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	int now = time(NULL);
+	if(tv == NULL || tv[0].tv_nsec != UTIME_OMIT)
+	{
+		temp_ino -> last_accessed = (tv == NULL || tv[0].tv_nsec == UTIME_NOW) ? now : tv[0].tv_sec;
+	}
+	if(tv == NULL || tv[1].tv_nsec != UTIME_OMIT)
+	{
+		temp_ino -> last_modified = (tv == NULL || tv[1].tv_nsec == UTIME_NOW) ? now : tv[1].tv_sec;
+	}
+	mark_dirty(m, temp_ino, sizeof(inode));
+
+	commit_change(m);
+	return 0;
+}
+
+
+//-----------------------------------------------------------------------------------------EXTENDED ATTRIBUTES---------------------------------------------------------------------------------------
+
+//FNV-1a, used to find identical shared xattr blocks
+static unsigned int xattr_hash(const char *data, int len)
+{
+	unsigned int h = 2166136261u;
+	for(int i = 0; i < len; i++)
+	{
+		h = (h ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return h;
+}
+
+
+//Iterate over the xattr_entry records of an area, returns NULL once the list ends
+static xattr_entry *xattr_next(char *area, int len, int *pos)
+{
+	if(*pos + (int)sizeof(xattr_entry) > len)
+	{
+		return NULL;
+	}
+	xattr_entry *e = (xattr_entry *)(area + *pos);
+	if(e -> name_len == 0)
+	{
+		return NULL;
+	}
+	*pos += XATTR_ENTRY_SIZE(e);
+	return e;
+}
+
+
+//Look name up in the inode's inline area, then in its shared block
+//Called with xattr_lock held
+static xattr_entry *xattr_find(myfs *m, int ino, const char *name)
+{
+	inode *temp_ino = m -> inodes + ino;
+	int name_len = strlen(name);
+	xattr_entry *e;
+	int pos = 0;
+
+	while((e = xattr_next((char *)temp_ino -> xattr_inline, XATTR_INLINE_SIZE, &pos)) != NULL)
+	{
+		if(e -> name_len == name_len && memcmp(e -> data, name, name_len) == 0)
+		{
+			return e;
+		}
+	}
+
+	if(temp_ino -> xattr_blk != 0)
+	{
+		xattr_header *hdr = (xattr_header *)(m -> datablks + (temp_ino -> xattr_blk) * BLK_SIZE);
+		pos = 0;
+		while((e = xattr_next((char *)(hdr + 1), hdr -> used, &pos)) != NULL)
+		{
+			if(e -> name_len == name_len && memcmp(e -> data, name, name_len) == 0)
+			{
+				return e;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+static void xattr_index_add(myfs *m, int blk)
+{
+	xattr_header *hdr = (xattr_header *)(m -> datablks + blk * BLK_SIZE);
+	int bucket = hdr -> hash % XATTR_INDEX_SIZE;
+
+	m -> xattr_chain[blk] = m -> xattr_index[bucket];
+	m -> xattr_index[bucket] = blk;
+}
+
+
+static void xattr_index_remove(myfs *m, int blk)
+{
+	xattr_header *hdr = (xattr_header *)(m -> datablks + blk * BLK_SIZE);
+	int *link = &m -> xattr_index[hdr -> hash % XATTR_INDEX_SIZE];
+
+	while(*link != 0 && *link != blk)
+	{
+		link = &m -> xattr_chain[*link];
+	}
+	if(*link == blk)
+	{
+		*link = m -> xattr_chain[blk];
+	}
+}
+
+
+//The index and the cache only live in memory, rebuild the index from the inodes on mount
+//(block 0 is the root directory, so 0 doubles as the end of a chain)
+static void xattr_build_index(myfs *m)
+{
+	for(int i = 0; i < XATTR_CACHE_SIZE; i++)
+	{
+		m -> xattr_cache[i].ino = -1;
+	}
+
+	for(int ino = 0; ino < N_INODES; ino++)
+	{
+		int blk = (m -> inodes + ino) -> xattr_blk;
+		if(m -> inode_map[ino] == 0 || blk == 0)
+		{
+			continue;
+		}
+
+		//shared blocks are reachable from several inodes, index them once
+		bool indexed = false;
+		for(int b = m -> xattr_index[((xattr_header *)(m -> datablks + blk * BLK_SIZE)) -> hash % XATTR_INDEX_SIZE]; b != 0; b = m -> xattr_chain[b])
+		{
+			if(b == blk)
+			{
+				indexed = true;
+				break;
+			}
+		}
+		if(!indexed)
+		{
+			xattr_index_add(m, blk);
+		}
+	}
+}
+
+
+//Drop one reference to a shared xattr block, freeing it with the last one
+//Called with xattr_lock held
+static void xattr_release_block(myfs *m, int blk)
+{
+	xattr_header *hdr = (xattr_header *)(m -> datablks + blk * BLK_SIZE);
+
+	mark_dirty(m, hdr, sizeof(xattr_header));
+	if(--(hdr -> refcount) == 0)
+	{
+		xattr_index_remove(m, blk);
+		release_datablock(m, blk);
+	}
+}
+
+
+//Lay out a complete attribute set for ino: records go inline while they fit, the rest
+//into a shared block, reusing an existing block with identical contents if there is one
+//Called with xattr_lock held
+static int xattr_store(myfs *m, int ino, const char *set, int len)
+{
+	inode *temp_ino = m -> inodes + ino;
+	unsigned char inline_area[XATTR_INLINE_SIZE];
+	char *blk_area = calloc(1, XATTR_BLK_SPACE);
+	int inline_used = 0, blk_used = 0;
+	xattr_entry *e;
+	int pos = 0;
+
+	memset(inline_area, 0, XATTR_INLINE_SIZE);
+	while((e = xattr_next((char *)set, len, &pos)) != NULL)
+	{
+		int sz = XATTR_ENTRY_SIZE(e);
+		if(inline_used + sz <= XATTR_INLINE_SIZE)
+		{
+			memcpy(inline_area + inline_used, e, sz);
+			inline_used += sz;
+		}
+		else if(blk_used + sz <= XATTR_BLK_SPACE)
+		{
+			memcpy(blk_area + blk_used, e, sz);
+			blk_used += sz;
+		}
+		else
+		{
+			free(blk_area);
+			return -ENOSPC;
+		}
+	}
+
+	int new_blk = 0;
+	if(blk_used > 0)
+	{
+		unsigned int hash = xattr_hash(blk_area, blk_used);
+
+		for(int b = m -> xattr_index[hash % XATTR_INDEX_SIZE]; b != 0; b = m -> xattr_chain[b])
+		{
+			xattr_header *hdr = (xattr_header *)(m -> datablks + b * BLK_SIZE);
+			if(hdr -> hash == hash && hdr -> used == blk_used && memcmp(hdr + 1, blk_area, blk_used) == 0)
+			{
+				hdr -> refcount++;
+				mark_dirty(m, hdr, sizeof(xattr_header));
+				new_blk = b;
+				break;
+			}
+		}
+
+		if(new_blk == 0)
+		{
+			int group = ino / INODES_PER_GROUP;
+			for(int i = 0; i < N_GROUPS && new_blk <= 0; i++)
+			{
+				new_blk = return_offset_of_first_free_datablock(m, (group + i) % N_GROUPS);
+			}
+			if(new_blk <= 0)
+			{
+				free(blk_area);
+				return -ENOSPC;
+			}
+
+			xattr_header *hdr = (xattr_header *)(m -> datablks + new_blk * BLK_SIZE);
+			hdr -> refcount = 1;
+			hdr -> hash = hash;
+			hdr -> used = blk_used;
+			memcpy(hdr + 1, blk_area, blk_used);
+			mark_dirty(m, hdr, sizeof(xattr_header) + blk_used);
+			xattr_index_add(m, new_blk);
+		}
+	}
+	free(blk_area);
+
+	//the old block may be the very one picked above, its refcount was raised first
+	if(temp_ino -> xattr_blk != 0)
+	{
+		xattr_release_block(m, temp_ino -> xattr_blk);
+	}
+	temp_ino -> xattr_blk = new_blk;
+	memcpy(temp_ino -> xattr_inline, inline_area, XATTR_INLINE_SIZE);
+	mark_dirty(m, temp_ino, sizeof(inode));
+	m -> xattr_gen[ino]++;
+	return 0;
+}
+
+
+//Set (value != NULL) or remove (value == NULL) one attribute of ino
+//flags are XATTR_CREATE / XATTR_REPLACE as passed to setxattr
+static int xattr_update(myfs *m, int ino, const char *name, const char *value, int size, int flags)
+{
+	inode *temp_ino = m -> inodes + ino;
+	int name_len = strlen(name);
+
+	if(name_len == 0 || name_len > 255 || size > 0xffff)
+	{
+		return -ERANGE;
+	}
+
+	pthread_mutex_lock(&m -> xattr_lock);
+
+	xattr_entry *old = xattr_find(m, ino, name);
+	if(value == NULL && old == NULL)
+	{
+		pthread_mutex_unlock(&m -> xattr_lock);
+		return -ENODATA;
+	}
+	if((flags & XATTR_CREATE) && old != NULL)
+	{
+		pthread_mutex_unlock(&m -> xattr_lock);
+		return -EEXIST;
+	}
+	if((flags & XATTR_REPLACE) && old == NULL)
+	{
+		pthread_mutex_unlock(&m -> xattr_lock);
+		return -ENODATA;
+	}
+
+	//gather every other record, then append the new one
+	int cap = XATTR_INLINE_SIZE + XATTR_BLK_SPACE + sizeof(xattr_entry) + name_len + size;
+	char *set = malloc(cap);
+	int len = 0;
+	xattr_entry *e;
+	int pos = 0;
+
+	while((e = xattr_next((char *)temp_ino -> xattr_inline, XATTR_INLINE_SIZE, &pos)) != NULL)
+	{
+		if(e != old)
+		{
+			memcpy(set + len, e, XATTR_ENTRY_SIZE(e));
+			len += XATTR_ENTRY_SIZE(e);
+		}
+	}
+	if(temp_ino -> xattr_blk != 0)
+	{
+		xattr_header *hdr = (xattr_header *)(m -> datablks + (temp_ino -> xattr_blk) * BLK_SIZE);
+		pos = 0;
+		while((e = xattr_next((char *)(hdr + 1), hdr -> used, &pos)) != NULL)
+		{
+			if(e != old)
+			{
+				memcpy(set + len, e, XATTR_ENTRY_SIZE(e));
+				len += XATTR_ENTRY_SIZE(e);
+			}
+		}
+	}
+	if(value != NULL)
+	{
+		e = (xattr_entry *)(set + len);
+		e -> name_len = name_len;
+		e -> value_len = size;
+		memcpy(e -> data, name, name_len);
+		memcpy(e -> data + name_len, value, size);
+		len += XATTR_ENTRY_SIZE(e);
+	}
+
+	int res = xattr_store(m, ino, set, len);
+	free(set);
+	pthread_mutex_unlock(&m -> xattr_lock);
+	return res;
+}
+
+
+//An inode is going away, let go of its shared block and anything cached for it
+static void xattr_drop(myfs *m, int ino)
+{
+	pthread_mutex_lock(&m -> xattr_lock);
+	if((m -> inodes + ino) -> xattr_blk != 0)
+	{
+		xattr_release_block(m, (m -> inodes + ino) -> xattr_blk);
+		(m -> inodes + ino) -> xattr_blk = 0;
+		mark_dirty(m, m -> inodes + ino, sizeof(inode));
+	}
+	m -> xattr_gen[ino]++;
+	pthread_mutex_unlock(&m -> xattr_lock);
+}
+
+
+int myfs_setxattr(myfs *m, int ino, const char *name, const char *value, size_t size, int flags)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	res = xattr_update(m, ino, name, value, size, flags);
+	if(res == 0)
+	{
+		commit_change(m);
+	}
+	return res;
+}
+
+
+//Served from xattr_cache when possible, the kernel asks for security.* on every open and write
+int myfs_getxattr(myfs *m, int ino, const char *name, char *value, size_t size)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	unsigned int slot = (xattr_hash(name, strlen(name)) ^ (ino * 2654435761u)) % XATTR_CACHE_SIZE;
+	xattr_cache_entry *c = &m -> xattr_cache[slot];
+	int len;
+
+	pthread_mutex_lock(&m -> xattr_lock);
+	if(c -> ino == ino && c -> gen == m -> xattr_gen[ino] && strcmp(c -> name, name) == 0)
+	{
+		len = c -> value_len;
+		if(len > 0 && size != 0 && (size_t)len <= size)
+		{
+			memcpy(value, c -> value, len);
+		}
+	}
+	else
+	{
+		xattr_entry *e = xattr_find(m, ino, name);
+		len = (e == NULL) ? -1 : e -> value_len;
+		if(e != NULL && size != 0 && (size_t)len <= size)
+		{
+			memcpy(value, e -> data + e -> name_len, len);
+		}
+
+		//keep small ones (and misses) around
+		if(strlen(name) < sizeof(c -> name) && len <= (int)sizeof(c -> value))
+		{
+			c -> ino = ino;
+			c -> gen = m -> xattr_gen[ino];
+			strcpy(c -> name, name);
+			c -> value_len = len;
+			if(len > 0)
+			{
+				memcpy(c -> value, e -> data + e -> name_len, len);
+			}
+		}
+	}
+	pthread_mutex_unlock(&m -> xattr_lock);
+
+	if(len == -1)
+	{
+		return -ENODATA;
+	}
+	if(size != 0 && (size_t)len > size)
+	{
+		return -ERANGE;
+	}
+	return len;
+}
+
+
+int myfs_listxattr(myfs *m, int ino, char *list, size_t size)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	inode *temp_ino = m -> inodes + ino;
+	size_t total = 0;
+	xattr_entry *e;
+	int pos = 0;
+
+	//names go out NUL separated, size 0 only asks for the length
+	pthread_mutex_lock(&m -> xattr_lock);
+	while((e = xattr_next((char *)temp_ino -> xattr_inline, XATTR_INLINE_SIZE, &pos)) != NULL)
+	{
+		if(size != 0 && total + e -> name_len + 1 <= size)
+		{
+			memcpy(list + total, e -> data, e -> name_len);
+			list[total + e -> name_len] = '\0';
+		}
+		total += e -> name_len + 1;
+	}
+	if(temp_ino -> xattr_blk != 0)
+	{
+		xattr_header *hdr = (xattr_header *)(m -> datablks + (temp_ino -> xattr_blk) * BLK_SIZE);
+		pos = 0;
+		while((e = xattr_next((char *)(hdr + 1), hdr -> used, &pos)) != NULL)
+		{
+			if(size != 0 && total + e -> name_len + 1 <= size)
+			{
+				memcpy(list + total, e -> data, e -> name_len);
+				list[total + e -> name_len] = '\0';
+			}
+			total += e -> name_len + 1;
+		}
+	}
+	pthread_mutex_unlock(&m -> xattr_lock);
+
+	if(size != 0 && total > size)
+	{
+		return -ERANGE;
+	}
+	return total;
+}
+
+
+int myfs_removexattr(myfs *m, int ino, const char *name)
+{
+	int res = check_inode(m, ino);
+	if(res != 0)
+	{
+		return res;
+	}
+
+	res = xattr_update(m, ino, name, NULL, 0, 0);
+	if(res == 0)
+	{
+		commit_change(m);
+	}
+	return res;
+}
+
+
+//-----------------------------------------------------------------------------------------PERSISTENCE---------------------------------------------------------------------------------------
+
+//Remember that [addr, addr + len) of the image changed, persist_fs only writes back these blocks
+static void mark_dirty(myfs *m, void *addr, size_t len)
+{
+	if(len == 0)
+	{
+		return;
+	}
+
+	size_t first = ((char *)addr - m -> fs) / BLK_SIZE;
+	size_t last = ((char *)addr - m -> fs + len - 1) / BLK_SIZE;
+
+	pthread_mutex_lock(&m -> dirty_lock);
+	for(size_t b = first; b <= last; b++)
+	{
+		m -> dirty[b] = true;
+	}
+	pthread_mutex_unlock(&m -> dirty_lock);
+}
+
+
+//Hand the dirty runs of the image to the I/O engine
+//With the uring engine this returns as soon as they are submitted, the reaper thread waits for the disk
+//The dirty map is taken over under dirty_lock and the I/O done after dropping it, so that changes
+//in the meantime only wait for the copy; what they dirty again goes out with the next call
+static void persist_fs(myfs *m)
+{
+	if(m -> flags & MYFS_READ_ONLY)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&m -> persist_lock);
+	pthread_mutex_lock(&m -> dirty_lock);
+	memcpy(m -> flushing, m -> dirty, sizeof(m -> dirty));
+	memset(m -> dirty, 0, sizeof(m -> dirty));
+	pthread_mutex_unlock(&m -> dirty_lock);
+
+	for(int b = 0; b < FS_BLKS; b++)
+	{
+		if(!m -> flushing[b])
+		{
+			continue;
+		}
+
+		int run = b;
+		while(run < FS_BLKS && m -> flushing[run])
+		{
+			run++;
+		}
+		queue_run(m, b, run);
+		b = run;
+	}
+	m -> engine -> submit(m -> engine_state);
+	pthread_mutex_unlock(&m -> persist_lock);
+}
+
+
+//Queue image blocks b to end - 1, in a striped image data runs are cut at stripe unit boundaries
+//and each piece goes to its data file; the engine submits them together, so the disks write in parallel
+static void queue_run(myfs *m, int b, int end)
+{
+	while(b < end)
+	{
+		int next = end;
+		int fd = m -> fs_file;
+		off_t offset = (off_t)b * BLK_SIZE;
+
+		if(m -> n_devices > 0 && b >= META_BLKS)
+		{
+			int blk = b - META_BLKS;
+			int unit_end = META_BLKS + (blk / m -> stripe_blks + 1) * m -> stripe_blks;
+			next = end < unit_end ? end : unit_end;
+			fd = m -> dev_files[STRIPE_DEVICE(blk, m -> n_devices, m -> stripe_blks)];
+			offset = STRIPE_OFFSET(blk, m -> n_devices, m -> stripe_blks);
+		}
+		else if(m -> n_devices > 0 && end > META_BLKS)
+		{
+			next = META_BLKS;
+		}
+
+		m -> engine -> queue_write(m -> engine_state, fd, m -> fs + (size_t)b * BLK_SIZE, (size_t)(next - b) * BLK_SIZE, offset);
+		b = next;
+	}
+}
+
+
+//A call changed the image: write it back now, unless the caller batches with MYFS_DEFER_SYNC
+static void commit_change(myfs *m)
+{
+	if(!(m -> flags & MYFS_DEFER_SYNC))
+	{
+		persist_fs(m);
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef LIBMYFS_H
+#define LIBMYFS_H
+
+// libmyfs: the MyFileSystem core, usable without FUSE
+// The myfs daemon is a frontend over it, batch jobs and tests link it directly
+//
+// Every call returns 0 (or an inode number / byte count) on success and -errno on failure,
+// the same values the FUSE handlers hand back to the kernel
+//
+// Calls may come from several threads at once: each directory has a lock that lookups and
+// readdir take shared and changes to its entries (create, mkdir, unlink, rmdir in it) exclusive
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+
+typedef struct myfs myfs;
+
+
+// Flags for myfs_mount
+#define MYFS_DEFER_SYNC 1			// Keep changes in memory until myfs_sync / myfs_unmount instead of writing them back on every call
+#define MYFS_READ_ONLY 2			// Open the files read-only and never write them, changes (access times...) stay in memory
+
+#define MYFS_DEFAULT_STRIPE (64 * 1024)	// Stripe unit the tools use unless told otherwise
+
+
+// Called by myfs_readdir for every entry, a non zero return stops the listing
+typedef int (*myfs_filldir)(void *arg, const char *name, int ino, bool dir);
+
+
+// Images
+// An empty (0 byte) image is formatted, one without this version's layout gives -EINVAL (it is left alone, the
+// tools rebuild it: myfs-pack -x it with the myfs-pack it was made with, then pack into an empty image)
+myfs *myfs_mount(const char *image, int flags, int *err);	// NULL and *err on failure
+// The same with the data blocks striped over n_devices (up to 8) existing data files, stripe_unit bytes (a multiple of 4 KiB)
+// at a time; the image file keeps the metadata. An image formatted for other data files (each carries the image's id and
+// its index, written at format), for them in another order or for another unit gives -EINVAL
+myfs *myfs_mount_striped(const char *image, const char *const *devices, int n_devices, size_t stripe_unit, int flags, int *err);
+int myfs_set_engine(myfs *m, const char *name);				// "sync" (default) or "uring", see io_engine.h
+void myfs_sync(myfs *m);									// Hand every change made so far to the I/O engine
+void myfs_unmount(myfs *m);									// Sync, wait for the engine and free the context
+
+// Names
+int myfs_lookup(myfs *m, const char *path);					// Inode number of an absolute path
+int myfs_lookupat(myfs *m, int dir, const char *name);		// Inode number of name in the directory dir
+int myfs_open(myfs *m, const char *path, int flags);		// myfs_lookup, creating the file with O_CREAT (and failing if it exists with O_EXCL), emptying it with O_TRUNC
+int myfs_readdir(myfs *m, int dir, myfs_filldir fill, void *arg);
+int myfs_statfs(myfs *m, struct statvfs *st);				// Space counted in FRAG_SIZE units (f_frsize), free slots of shared fragment blocks included
+
+// Inodes by number, the directory calls return the new inode number
+// A new name is one path component: one with a '/', "." or ".." gives -EINVAL
+int myfs_stat(myfs *m, int ino, struct stat *st);
+int myfs_createat(myfs *m, int dir, const char *name);
+int myfs_mkdirat(myfs *m, int dir, const char *name);
+int myfs_unlinkat(myfs *m, int dir, const char *name);
+int myfs_rmdirat(myfs *m, int dir, const char *name);
+int myfs_read(myfs *m, int ino, char *buf, size_t size, off_t offset);
+int myfs_write(myfs *m, int ino, const char *buf, size_t size, off_t offset);	// Bytes written, files end at MAX_FILE_SIZE (myfs.h)
+int myfs_truncate(myfs *m, int ino, off_t size);			// Growing a file leaves a hole, ranges never written take no blocks and read as zeros
+int myfs_fallocate(myfs *m, int ino, off_t offset, off_t len);	// Blocks (or fragments) for the range now, zeroed and placed as writes would place them, the file grows to cover it
+off_t myfs_lseek(myfs *m, int ino, off_t offset, int whence);	// SEEK_DATA or SEEK_HOLE, the offset found or -ENXIO past the last data
+int myfs_utimens(myfs *m, int ino, const struct timespec tv[2]);
+
+// The same on paths
+int myfs_create(myfs *m, const char *path);
+int myfs_mkdir(myfs *m, const char *path);
+int myfs_unlink(myfs *m, const char *path);
+int myfs_rmdir(myfs *m, const char *path);
+
+// Extended attributes, flags as setxattr(2), size 0 only asks for the length
+int myfs_setxattr(myfs *m, int ino, const char *name, const char *value, size_t size, int flags);
+int myfs_getxattr(myfs *m, int ino, const char *name, char *value, size_t size);
+int myfs_listxattr(myfs *m, int ino, char *list, size_t size);
+int myfs_removexattr(myfs *m, int ino, const char *name);
+
+#endif
@@ -0,0 +1,617 @@
+#define _GNU_SOURCE
+
+
+// Preprocessor Directives
+#include "libmyfs.h"
+#include "myfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/xattr.h>
+
+
+// Macros
+#define MAX_THREADS 64
+#define XATTR_LIST_SIZE 4096
+#define XATTR_VALUE_SIZE 4096
+
+
+// One file or directory to copy, directories come before everything below them
+typedef struct
+{
+	char *host;						// Path on the host
+	int ino;						// Inode in the image
+	bool dir;
+} job;
+
+
+// Helper Functions
+void usage();
+void add_job(const char *host, int ino, bool dir);
+char *join(const char *dir, const char *name);
+int pack(const char *src, const char *image);
+int unpack(const char *image, const char *dest);
+void run_parallel(void *(*fn)(void *));
+void *copy_in_worker(void *arg);
+void reserve_data(const char *host, int ino);
+void *copy_out_worker(void *arg);
+void copy_xattrs_in(job *j);
+void copy_xattrs_out(job *j);
+int collect_name(void *arg, const char *name, int ino, bool dir);
+void error(const char *what, const char *path, int err);
+
+
+// Global Variables
+myfs *m;
+int n_threads;
+const char *devices[MAX_DEVICES];						// Data files of a striped image, -d in mount order
+int n_devices;
+size_t stripe_unit = MYFS_DEFAULT_STRIPE;
+
+job *jobs;												// Every file and directory, in the order they are allocated
+int n_jobs, jobs_cap;
+int next_job;											// Next job a worker takes
+
+int errors;												// Files that couldn't be copied, the exit status is 1 if there are any
+unsigned long space_used;								// Bytes of data space the packed image uses, fragments counted as such
+pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//-----------------------------------------------------------------------------------------MAIN (DRIVER) Function---------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+	bool extract = false;
+	int opt;
+
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while((opt = getopt(argc, argv, "xj:d:s:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'x': extract = true; break;
+			case 'j': n_threads = atoi(optarg); break;
+			case 'd':
+				if(n_devices == MAX_DEVICES)
+				{
+					usage();
+					return 2;
+				}
+				devices[n_devices++] = optarg;
+				break;
+			case 's': stripe_unit = strtoul(optarg, NULL, 0); break;
+			default: usage(); return 2;
+		}
+	}
+	if(argc - optind != 2)
+	{
+		usage();
+		return 2;
+	}
+	if(n_threads < 1)
+	{
+		n_threads = 1;
+	}
+	if(n_threads > MAX_THREADS)
+	{
+		n_threads = MAX_THREADS;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int res = extract ? unpack(argv[optind], argv[optind + 1]) : pack(argv[optind], argv[optind + 1]);
+	if(res != 0)
+	{
+		return 2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%d files and directories in %.3f s, %d errors\n", n_jobs - 1,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, errors);
+	if(!extract)
+	{
+		printf("%lu KiB of data space used\n", space_used / 1024);
+	}
+	return errors ? 1 : 0;
+}
+
+
+void usage()
+{
+	fprintf(stderr, "usage: myfs-pack [-j threads] [-d datafile]... [-s stripe] srcdir image\n");
+	fprintf(stderr, "       myfs-pack -x [-j threads] [-d datafile]... [-s stripe] image destdir\n");
+	fprintf(stderr, "-d once per data file of a striped image (at most %d), -s its stripe unit in bytes\n", MAX_DEVICES);
+}
+
+
+void add_job(const char *host, int ino, bool dir)
+{
+	if(n_jobs == jobs_cap)
+	{
+		jobs_cap = jobs_cap ? jobs_cap * 2 : 1024;
+		jobs = realloc(jobs, jobs_cap * sizeof(job));
+	}
+	jobs[n_jobs].host = strdup(host);
+	jobs[n_jobs].ino = ino;
+	jobs[n_jobs].dir = dir;
+	n_jobs++;
+}
+
+
+//Returns a malloc'ed dir/name
+char *join(const char *dir, const char *name)
+{
+	char *path;
+	if(asprintf(&path, "%s/%s", dir, name) < 0)
+	{
+		abort();
+	}
+	return path;
+}
+
+
+void error(const char *what, const char *path, int err)
+{
+	pthread_mutex_lock(&error_lock);
+	fprintf(stderr, "myfs-pack: %s %s: %s\n", what, path, strerror(err));
+	errors++;
+	pthread_mutex_unlock(&error_lock);
+}
+
+
+//Run fn on n_threads threads and wait for all of them
+void run_parallel(void *(*fn)(void *))
+{
+	pthread_t threads[MAX_THREADS];
+
+	next_job = 0;
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_create(&threads[t], NULL, fn, NULL);
+	}
+	for(int t = 0; t < n_threads; t++)
+	{
+		pthread_join(threads[t], NULL);
+	}
+}
+
+
+//-----------------------------------------------------------------------------------------PACK---------------------------------------------------------------------------------------
+
+//Build a fresh image from the tree at src
+//The tree is walked breadth first and every inode and block allocated in that one pass (file data
+//with myfs_fallocate, extent by extent), so each directory's entries and its files' blocks end up next
+//to each other. The pool then reads the files into the blocks in memory, which go to disk in one
+//sequential write at unmount
+int pack(const char *src, const char *image)
+{
+	//the image and its data files all start empty, but only once every one of them is locked:
+	//a file some mount (or fsck.myfs) holds is left as it was
+	int fds[MAX_DEVICES + 1];
+	int n_fds = 0, res = 0;
+	for(int d = -1; d < n_devices && res == 0; d++)
+	{
+		const char *path = d < 0 ? image : devices[d];
+		int fd = open(path, O_CREAT | O_RDWR, 0644);
+		if(fd < 0)
+		{
+			perror(path);
+			res = -1;
+		}
+		else if(flock(fd, LOCK_EX | LOCK_NB) != 0)
+		{
+			fprintf(stderr, "myfs-pack: %s: %s\n", path, errno == EWOULDBLOCK ? "in use, left alone" : strerror(errno));
+			close(fd);
+			res = -1;
+		}
+		else
+		{
+			fds[n_fds++] = fd;
+		}
+	}
+	for(int i = 0; i < n_fds && res == 0; i++)
+	{
+		if(ftruncate(fds[i], 0) != 0)
+		{
+			perror(i == 0 ? image : devices[i - 1]);
+			res = -1;
+		}
+	}
+	//the mount takes the locks over, a mount sneaking in between finds an empty image it formats itself
+	for(int i = 0; i < n_fds; i++)
+	{
+		close(fds[i]);
+	}
+	if(res != 0)
+	{
+		return -1;
+	}
+
+	int err;
+	m = myfs_mount_striped(image, devices, n_devices, stripe_unit, MYFS_DEFER_SYNC, &err);
+	if(m == NULL)
+	{
+		fprintf(stderr, "myfs-pack: %s: %s\n", image, strerror(-err));
+		return -1;
+	}
+	//a fresh image comes with a welcome file, the tree gets an empty root instead
+	myfs_unlink(m, "/Welcome");
+
+	add_job(src, myfs_lookup(m, "/"), true);
+	for(int i = 0; i < n_jobs; i++)
+	{
+		if(!jobs[i].dir)
+		{
+			continue;
+		}
+
+		DIR *d = opendir(jobs[i].host);
+		if(d == NULL)
+		{
+			error("reading", jobs[i].host, errno);
+			continue;
+		}
+
+		struct dirent *e;
+		while((e = readdir(d)) != NULL)
+		{
+			if(strcmp(e -> d_name, ".") == 0 || strcmp(e -> d_name, "..") == 0)
+			{
+				continue;
+			}
+
+			char *path = join(jobs[i].host, e -> d_name);
+			struct stat st;
+			int ino;
+
+			if(lstat(path, &st) != 0)
+			{
+				error("reading", path, errno);
+			}
+			else if(S_ISDIR(st.st_mode))
+			{
+				ino = myfs_mkdirat(m, jobs[i].ino, e -> d_name);
+				if(ino < 0)
+				{
+					error("creating", path, -ino);
+				}
+				else
+				{
+					add_job(path, ino, true);
+				}
+			}
+			else if(!S_ISREG(st.st_mode))
+			{
+				error("skipping", path, EINVAL);
+			}
+			else if(st.st_size > MAX_FILE_SIZE)
+			{
+				error("skipping", path, EFBIG);
+			}
+			else
+			{
+				ino = myfs_createat(m, jobs[i].ino, e -> d_name);
+				if(ino < 0)
+				{
+					error("creating", path, -ino);
+				}
+				else
+				{
+					reserve_data(path, ino);
+					add_job(path, ino, false);
+				}
+			}
+			free(path);
+		}
+		closedir(d);
+	}
+
+	run_parallel(copy_in_worker);
+
+	struct statvfs st;
+	myfs_statfs(m, &st);
+	space_used = (st.f_blocks - st.f_bfree) * st.f_frsize;
+	myfs_unmount(m);
+	return 0;
+}
+
+
+//Allocate the blocks of the host file's data extents in the image, the workers fill them in later
+//Errors are left to the worker, which meets them again when it copies the file
+void reserve_data(const char *host, int ino)
+{
+	int fd = open(host, O_RDONLY);
+	if(fd < 0)
+	{
+		return;
+	}
+
+	struct stat st;
+	off_t data = fstat(fd, &st) == 0 ? lseek(fd, 0, SEEK_DATA) : -1;
+	if(data < 0 && errno != ENXIO)
+	{
+		data = 0;
+	}
+	while(data >= 0 && data < st.st_size)
+	{
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if(hole < 0 || hole > st.st_size)
+		{
+			hole = st.st_size;
+		}
+		if(myfs_fallocate(m, ino, data, hole - data) != 0)
+		{
+			break;
+		}
+		data = lseek(fd, hole, SEEK_DATA);
+	}
+	close(fd);
+}
+
+
+void *copy_in_worker(void *arg)
+{
+	(void) arg;
+	char *buf = malloc(MAX_FILE_SIZE);
+
+	for(;;)
+	{
+		int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+		if(i >= n_jobs)
+		{
+			break;
+		}
+
+		job *j = &jobs[i];
+		copy_xattrs_in(j);
+		if(j -> dir)
+		{
+			continue;
+		}
+
+		int fd = open(j -> host, O_RDONLY);
+		if(fd < 0)
+		{
+			error("reading", j -> host, errno);
+			continue;
+		}
+
+		//only the host file's data extents are copied, its holes stay holes in the image
+		//(where the host can't tell, lseek fails and the whole file counts as data)
+		struct stat st;
+		int res = fstat(fd, &st) != 0 ? -errno : 0;
+		if(res == 0 && st.st_size > MAX_FILE_SIZE)
+		{
+			res = -EFBIG;
+		}
+		off_t data = lseek(fd, 0, SEEK_DATA);
+		if(data < 0 && errno != ENXIO)
+		{
+			data = 0;
+		}
+		while(res == 0 && data >= 0 && data < st.st_size)
+		{
+			off_t hole = lseek(fd, data, SEEK_HOLE);
+			if(hole < 0 || hole > st.st_size)
+			{
+				hole = st.st_size;
+			}
+
+			ssize_t len = pread(fd, buf, hole - data, data);
+			if(len < 0)
+			{
+				res = -errno;
+			}
+			else if(len > 0 && myfs_write(m, j -> ino, buf, len, data) != len)
+			{
+				res = -ENOSPC;
+			}
+			data = lseek(fd, hole, SEEK_DATA);
+		}
+		close(fd);
+
+		//a trailing hole only shows in the size
+		if(res == 0)
+		{
+			res = myfs_truncate(m, j -> ino, st.st_size);
+		}
+		if(res < 0)
+		{
+			error("writing", j -> host, -res);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+
+//Copy the host file's user.* attributes, the only ones an unprivileged copy can read back
+void copy_xattrs_in(job *j)
+{
+	char list[XATTR_LIST_SIZE], value[XATTR_VALUE_SIZE];
+	ssize_t len = llistxattr(j -> host, list, sizeof(list));
+
+	for(ssize_t pos = 0; pos < len; pos += strlen(list + pos) + 1)
+	{
+		if(strncmp(list + pos, "user.", 5) != 0)
+		{
+			continue;
+		}
+		ssize_t size = lgetxattr(j -> host, list + pos, value, sizeof(value));
+		int res = size < 0 ? -errno : myfs_setxattr(m, j -> ino, list + pos, value, size, 0);
+		if(res < 0)
+		{
+			error("copying attributes of", j -> host, -res);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------------------UNPACK---------------------------------------------------------------------------------------
+
+// Entries of one directory in the image, gathered by collect_name
+typedef struct
+{
+	char **names;
+	int *inos;
+	bool *dirs;
+	int n, cap;
+} name_list;
+
+
+int collect_name(void *arg, const char *name, int ino, bool dir)
+{
+	name_list *l = arg;
+
+	if(l -> n == l -> cap)
+	{
+		l -> cap = l -> cap ? l -> cap * 2 : 64;
+		l -> names = realloc(l -> names, l -> cap * sizeof(char *));
+		l -> inos = realloc(l -> inos, l -> cap * sizeof(int));
+		l -> dirs = realloc(l -> dirs, l -> cap * sizeof(bool));
+	}
+	l -> names[l -> n] = strdup(name);
+	l -> inos[l -> n] = ino;
+	l -> dirs[l -> n] = dir;
+	l -> n++;
+	return 0;
+}
+
+
+//Recreate the image's tree under dest: directories first, then the files by the pool
+int unpack(const char *image, const char *dest)
+{
+	int err;
+	m = myfs_mount_striped(image, devices, n_devices, stripe_unit, MYFS_READ_ONLY, &err);
+	if(m == NULL)
+	{
+		fprintf(stderr, "myfs-pack: %s: %s\n", image, err == -EINVAL ? "not an image of this version (or of other data files)" : strerror(-err));
+		return -1;
+	}
+	if(mkdir(dest, 0755) != 0 && errno != EEXIST)
+	{
+		perror(dest);
+		myfs_unmount(m);
+		return -1;
+	}
+
+	add_job(dest, myfs_lookup(m, "/"), true);
+	for(int i = 0; i < n_jobs; i++)
+	{
+		if(!jobs[i].dir)
+		{
+			continue;
+		}
+
+		name_list l = { NULL, NULL, NULL, 0, 0 };
+		myfs_readdir(m, jobs[i].ino, collect_name, &l);
+
+		for(int k = 0; k < l.n; k++)
+		{
+			char *path = join(jobs[i].host, l.names[k]);
+
+			if(!l.dirs[k])
+			{
+				add_job(path, l.inos[k], false);
+			}
+			else if(mkdir(path, 0755) != 0 && errno != EEXIST)
+			{
+				error("creating", path, errno);
+			}
+			else
+			{
+				add_job(path, l.inos[k], true);
+			}
+			free(path);
+			free(l.names[k]);
+		}
+		free(l.names);
+		free(l.inos);
+		free(l.dirs);
+	}
+
+	run_parallel(copy_out_worker);
+	myfs_unmount(m);
+	return 0;
+}
+
+
+void *copy_out_worker(void *arg)
+{
+	(void) arg;
+	char *buf = malloc(MAX_FILE_SIZE);
+
+	for(;;)
+	{
+		int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+		if(i >= n_jobs)
+		{
+			break;
+		}
+
+		job *j = &jobs[i];
+		if(!j -> dir)
+		{
+			//holes are skipped, the host file gets them back from ftruncate
+			struct stat st;
+			int fd = open(j -> host, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+			int res = fd < 0 ? -errno : myfs_stat(m, j -> ino, &st);
+			off_t data = myfs_lseek(m, j -> ino, 0, SEEK_DATA);
+			while(res == 0 && data >= 0)
+			{
+				off_t hole = myfs_lseek(m, j -> ino, data, SEEK_HOLE);
+				int len = myfs_read(m, j -> ino, buf, hole - data, data);
+				if(len < 0)
+				{
+					res = len;
+				}
+				else if(pwrite(fd, buf, len, data) != len)
+				{
+					res = -errno;
+				}
+				data = myfs_lseek(m, j -> ino, hole, SEEK_DATA);
+			}
+			if(res == 0 && ftruncate(fd, st.st_size) != 0)
+			{
+				res = -errno;
+			}
+			if(res < 0)
+			{
+				error("writing", j -> host, -res);
+			}
+			if(fd >= 0)
+			{
+				close(fd);
+			}
+		}
+		copy_xattrs_out(j);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+void copy_xattrs_out(job *j)
+{
+	char list[XATTR_LIST_SIZE], value[XATTR_VALUE_SIZE];
+	int len = myfs_listxattr(m, j -> ino, list, sizeof(list));
+
+	for(int pos = 0; pos < len; pos += strlen(list + pos) + 1)
+	{
+		int size = myfs_getxattr(m, j -> ino, list + pos, value, sizeof(value));
+		if(size < 0 || lsetxattr(j -> host, list + pos, value, size, 0) != 0)
+		{
+			error("copying attributes to", j -> host, size < 0 ? -size : errno);
+		}
+	}
+}
@@ -1,23 +1,28 @@
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
 
 
 // Preprocessor Directives
 #include <fuse.h>
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <pthread.h>
+#include <stddef.h>
+#include "libmyfs.h"
+#include "io_engine.h"
 
 
 // File Operations Prototypes
-//static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+static void fs_destroy(void *private_data);
 static int fs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
 static int fs_mkdir(const char *path, mode_t mode);
 static int fs_rmdir(const char *path);
 static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
@@ -25,13 +30,21 @@ static int fs_open(const char *path, struct fuse_file_info *fi);
 static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 static int fs_rm(const char *path);
+static int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+static int fs_getxattr(const char *path, const char *name, char *value, size_t size);
+static int fs_listxattr(const char *path, char *list, size_t size);
+static int fs_removexattr(const char *path, const char *name);
+static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+static int fs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi);
+static off_t fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi);
+static int fs_statfs(const char *path, struct statvfs *st);
 //static int fs_rename(const char *from, const char *to, unsigned int flags);
-//static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
- 
+
 
 // Fuse Operations
 static struct fuse_operations fs_oper = {
- 	// .init 		= fs_init,
+ 	.init 		= fs_init,
+ 	.destroy	= fs_destroy,
 	.getattr    = fs_getattr,
     .readdir	= fs_readdir,
     .mkdir		= fs_mkdir,
@@ -41,418 +54,322 @@ static struct fuse_operations fs_oper = {
     .read       = fs_read,
     .write      = fs_write,
     .unlink	 	= fs_rm,
+    .setxattr	= fs_setxattr,
+    .getxattr	= fs_getxattr,
+    .listxattr	= fs_listxattr,
+    .removexattr = fs_removexattr,
+    .truncate 	= fs_truncate,
+    .utimens	= fs_utimens,
+    .lseek		= fs_lseek,
+    .statfs		= fs_statfs,
     // .rename 		= fs_rename,
-    // .truncate 	= fs_truncate
 };
 
 
-// Structure for Inodes
-typedef struct 
-{
-	bool used;                  // Checks the validity of the inodes, whether it is available
-    int id;						// ID for the inode
-    size_t size;				// Size of the file
-    int data;					// Offset of data block
-    bool directory;				// Checks if the entity is a Directory or a File
-    int link_count; 			// Link Count: 2 -> Directory, 1 -> File
-    int last_accessed;			// Last accessed time
-    int last_modified;			// Last modified time
-} __attribute__((packed, aligned(1))) inode;
-
-
-// Structure for Directory Entry
+// What fs_readdir hands to myfs_readdir
 typedef struct
 {
-	char filename[15];
-	int file_inode;
-} dirent;
-
-// Size of dirent = 16 bytes
-// Hence in a 512 B block we can have 32 directory entries
+	void *buf;
+	fuse_fill_dir_t filler;
+} readdir_state;
 
 
 // Macros
-#define BLK_SIZE (1 << 12)
+#define MAX_NO_OF_OPEN_FILES 10
 
-#define N_INODES 100
-#define DBLKS_PER_INODE 1
-#define DBLKS (DBLKS_PER_INODE * N_INODES)
+// Kernel cache timeouts (in seconds), safe to keep long since every change is invalidated below
+#define ENTRY_TIMEOUT 300.0
+#define ATTR_TIMEOUT 300.0
+#define NEGATIVE_TIMEOUT 60.0
 
-#define ROUND_UP_DIV(x, y) (((x) + (y) - 1) / (y))
+#define INVAL_QUEUE_LEN 64								// Starting size of the invalidation queue, it doubles when full
 
-#define FREEMAP_BLKS ROUND_UP_DIV(DBLKS, BLK_SIZE)
-#define INODE_BLKS ROUND_UP_DIV(N_INODES*sizeof(inode), BLK_SIZE)
-#define INODE_MAP_BLKS ROUND_UP_DIV(DBLKS, BLK_SIZE)
+// Largest read and write requests we ask the kernel for, it caps them at its own limit (1 MiB on current kernels)
+#define MAX_IO_SIZE (1 << 20)
 
-#define FS_SIZE (INODE_MAP_BLKS + INODE_BLKS + FREEMAP_BLKS + DBLKS) * BLK_SIZE
+#define DEBUG 2
 
-#define MAX_NO_OF_OPEN_FILES 10
 
-#define DEBUG 2
- 
- 
 // Helper Functions
-int initialise_inodes(int* i);
-int initialise_freemap(int* map);
-int return_first_unused_inode(int* i);
-int return_offset_of_first_free_datablock(int *freemap);
-int isDir(char *path);
-void path_to_inode(const char* path, int *ino);
-void allocate_inode(char *path, int *ino, bool dir);
-void print_inode(inode *i);
+char *parent_path(const char *path);
+void parent_changed(const char *path);
+void invalidate_path(const char *path);
+void *invalidate_worker(void *arg);
+int fill_dir(void *arg, const char *name, int ino, bool dir);
+
+
+// Command line options, -o engine=sync|uring, -o devices=data0:data1:... and -o stripe=bytes
+struct options
+{
+	const char *engine;
+	char *devices;				// Data files to stripe the data blocks over, NULL keeps them in the image
+	int stripe;
+} options;
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("engine=%s", engine),
+	OPTION("devices=%s", devices),
+	OPTION("stripe=%d", stripe),
+	FUSE_OPT_END
+};
 
 
 // Global Variables
-int fs_file;
-char *fs;												// The start of the FileSystem in the memory
-int *inode_map;
-inode *inodes;											// The start of the inode block
-int *freemap;											// The start of the free-map block
-char *datablks;											// The start of the data_blockss
-
-dirent *root_directory; 								// Address of the block representing the root directory 
- 
- 
+myfs *ctx;												// The mounted image, every handler works through libmyfs.h
+
+bool writeback;											// The kernel caches writes and sends them back in large, page aligned batches
+struct fuse *fuse_handle;								// Handle used to send invalidations to the kernel
+char **inval_queue;										// Paths waiting to be invalidated in the kernel, a ring of inval_len
+int inval_head, inval_count, inval_len;
+bool inval_stop;
+pthread_t inval_thread;
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+
+
 //-----------------------------------------------------------------------------------------MAIN (DRIVER) Function---------------------------------------------------------------------------------------
 
 int main(int argc, char *argv[])
 {
-	fs_file = open("MyFileSystem", O_RDWR);
-	struct stat buf;
-	fstat(fs_file, &buf);
-	#ifdef DEBUG
-	printf("MyFileSystem size = %d\n", buf.st_size);
-	#endif
-	fs = calloc(1, FS_SIZE);
-
-	if(buf.st_size != 0)
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	options.engine = strdup("sync");
+	options.stripe = MYFS_DEFAULT_STRIPE;
+	if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
 	{
-		read(fs_file, fs, FS_SIZE);
+		return 1;
 	}
-	inode_map = (int *)fs;
-	inodes = (inode *)(inode_map + INODE_BLKS * BLK_SIZE);
-	freemap = (int *)(inodes + N_INODES * sizeof(inode));
-	datablks = (char *)(freemap + FREEMAP_BLKS * BLK_SIZE);
-	printf("fs = %u\n", fs);
-	printf("inode_map = %u\n", inode_map);
-	printf("inodes = %u\n", inodes);
-	printf("freemap = %u\n", freemap);
-	printf("datablks = %u\n", datablks);
-
-	if(buf.st_size == 0)
+	if(find_io_engine(options.engine) == NULL)
 	{
-		initialise_inodes(inode_map);
-		initialise_freemap(freemap);
+		fprintf(stderr, "unknown engine %s, expected sync or uring\n", options.engine);
+		return 1;
 	}
 
-  	printf("Welcome!!\n\n");
+	//max_read only takes effect as a mount option, fs_init asks for the matching max_write
+	char max_read[32];
+	snprintf(max_read, sizeof(max_read), "-omax_read=%d", MAX_IO_SIZE);
+	fuse_opt_add_arg(&args, max_read);
+
+	//one slot per name in devices=a:b:..., the library checks how many it can take
+	int n_devices = 1;
+	for(char *c = options.devices; c != NULL && *c != '\0'; c++)
+	{
+		n_devices += (*c == ':');
+	}
+	const char **devices = calloc(n_devices, sizeof(char *));
+	n_devices = 0;
+	for(char *save, *dev = options.devices ? strtok_r(options.devices, ":", &save) : NULL; dev != NULL; dev = strtok_r(NULL, ":", &save))
+	{
+		devices[n_devices++] = dev;
+	}
 
+	int err;
+	ctx = myfs_mount_striped("MyFileSystem", devices, n_devices, options.stripe, 0, &err);
+	free(devices);
+	if(ctx == NULL)
+	{
+		if(err == -EBUSY)
+		{
+			fprintf(stderr, "MyFileSystem is in use (mounted or being checked)\n");
+		}
+		else if(err == -EINVAL)
+		{
+			fprintf(stderr, "MyFileSystem: not an image of this version, or not for these data files (at most 8, a stripe unit in 4 KiB steps,\n"
+				"as the image was formatted with). It was left alone: check it with fsck.myfs, or rebuild it with myfs-pack\n");
+		}
+		else
+		{
+			fprintf(stderr, "MyFileSystem: %s\n", strerror(-err));
+		}
+		return 1;
+	}
 
-	// Initialising the root directory
-	root_directory = (dirent *)datablks;
+  	printf("Welcome!!\n\n");
 
-	printf("root_directory = %u\n", root_directory);
-	//printf("size of dirent = %d\n", sizeof(dirent));
-	// Adding a welcome file to the root_directory
-	//printf("%u\n%u\n", root_directory, root_directory -> filename);
-  	if(buf.st_size == 0)
-  	{
-  		strcpy(root_directory -> filename, "Welcome");
-	  	//printf("%u\n", root_directory -> filename);
-	  	//printf("Here\n");
-  		root_directory -> file_inode = return_first_unused_inode(inode_map);
-
-	    inode *temp;
-	    temp = inodes + ((root_directory -> file_inode) * sizeof(inode));
-	  	temp -> id = 1;
-	  	temp -> size = 30;
-	  	temp -> data = return_offset_of_first_free_datablock(freemap);
-	  	temp -> directory = false;
-	  	temp -> last_accessed = 0;
-	  	temp -> last_modified = 0;
-	  	temp -> link_count = 1;
-
-	  	//printf("inode of Welcome = %u\n", root_directory -> file_inode);
-	    char *data_temp = (datablks + ((temp -> data)*BLK_SIZE));
-	    strcpy(data_temp, "Welcome To Our File System!!!\n");
-
-	    write(fs_file, fs, FS_SIZE);
-	  	//printf("%d\n", return_offset_of_first_free_datablock(freemap));
-	  	/*
-	  	char *x = (char *)malloc(10);
-	  	strcpy(x, "/Welcome");
-	  	printf("inodes = %u\n", inodes);
-	  	inode *t =  path_to_inode(x);
-	  	printf("path_to_inode = \n%u\n", t);
-	  	printf("Here\n");
-	  	*/
-	  	//printf("%d\n%d\n", inodes->used, (inodes + 1) -> used);
-  	}
-  	else
-  	{
-    	printf("File System restored!!\n");
-  	}
-  	return fuse_main(argc, argv, &fs_oper, NULL);
+	//the chosen engine starts in fs_init, after fuse_main has daemonised (its threads would not survive the fork)
+  	int ret = fuse_main(args.argc, args.argv, &fs_oper, NULL);
+  	fuse_opt_free_args(&args);
+  	return ret;
 }
 
 
-int initialise_inodes(int* i)
+//Returns a malloc'ed copy of the directory part of the path ("/a/b" -> "/a", "/a" -> "/")
+char *parent_path(const char *path)
 {
-	// Initalise the inodes
-	// return 0 on success and -1 on some error
-	#ifdef DEBUG
-	printf("Initialising inodes\n");
-	#endif
+	char *parent = strdup(path);
+	char *slash = strrchr(parent, '/');
 
-	for(int x = 0; x < N_INODES; x++)
+	if(slash == parent)
 	{
-		*i = 0;
-		i ++;
+		slash[1] = '\0';
 	}
-	return 0;
-}
-
-
-int initialise_freemap(int* map)
-{
-	// Initalise the freemap
-	// return 0 on success and -1 on some error
-	#ifdef DEBUG
-	printf("Initialising freemap\n");
-	#endif
-	int x;
-	for(x = 0; x < DBLKS; x++)
+	else
 	{
-		*(map + x) = 1;
+		*slash = '\0';
 	}
-	*(map + x) = -1; // No more datablocks
-	return 0;
+	return parent;
 }
 
 
-//free inode function to search the inode bitmap
-int return_first_unused_inode(int* i)
+//The entries of the directory holding path changed (the library bumped its mtime), drop the kernel's view of it
+void parent_changed(const char *path)
 {
-	int ix;
-	for(ix = 1; ix < N_INODES; ix++,i++)
-  	{
-		if(*i == 0)
-    	{
-			*i = 1;
-			return ix;
-		}
-	}
-	return -1;
+	char *parent = parent_path(path);
+	invalidate_path(parent);
+	free(parent);
 }
 
 
-//free data block function to search the data bitmap
-int return_offset_of_first_free_datablock(int *freemap)
+//Queue a path whose kernel-cached attributes and pages are stale
+//The notification is sent from invalidate_worker, never from the handler itself:
+//the kernel may be holding locks on the very inode the handler is serving
+//Nothing is ever dropped (a stale cache would be served until its timeout): a path already waiting
+//is not queued twice, and a full queue doubles instead
+void invalidate_path(const char *path)
 {
-	int i;
-	for(i = 1; i < DBLKS; i++)
-  	{
-		//printf("%d\n", freemap[i]);
-		if(freemap[i] == 1)
-    	{
-			freemap[i] = 0; //mark it as used now
-			return (i);
+	pthread_mutex_lock(&inval_lock);
+	for(int i = 0; i < inval_count; i++)
+	{
+		if(strcmp(inval_queue[(inval_head + i) % inval_len], path) == 0)
+		{
+			pthread_mutex_unlock(&inval_lock);
+			return;
 		}
 	}
-	return -1;
-}
-
-
-//Parse the path to reach the correct inode using the directory entries
-void path_to_inode(const char* path, int *ino)
-{
-	// Given the path name it will return the inode address if it exists else it returns NULL
-	#ifdef DEBUG
-	printf("path_to_inode - path - %s\n", path);
-	#endif
 
-  	//if path itself is root -> already have pointer to the root directory
-  	//so dont search further
-	if(strcmp("/", path) == 0)
-  	{
-		*ino = (root_directory->file_inode);
+	if(inval_count == inval_len)
+	{
+		int len = inval_len ? inval_len * 2 : INVAL_QUEUE_LEN;
+		char **queue = malloc(len * sizeof(char *));
+		for(int i = 0; i < inval_count; i++)
+		{
+			queue[i] = inval_queue[(inval_head + i) % inval_len];
+		}
+		free(inval_queue);
+		inval_queue = queue;
+		inval_len = len;
+		inval_head = 0;
 	}
 
-  	//if not root -> start at root and search further
-	else
-  	{
-  		char *token = strtok(path, "/");
-  		dirent *temp;
-  		temp = root_directory;
-
-  		printf("root_directory -> filename = %s\n", (root_directory) -> filename);
-  	  	printf("temp -> filename = %s\n", temp->filename);
-
-      	while (token != NULL)
-      	{
-  			printf("token = %s\n", token);
-
-			while((strcmp(temp -> filename, "") != 0) && (strcmp(temp -> filename, token) != 0))
-          	{
-				temp++;
-				printf("temp = %u\n", temp);
-				printf("temp -> filename = %s\n", temp->filename);
-			}
-
-        	//if reached end of the path and temp is empty => NOT FOUND
-  			if(strcmp(temp -> filename, "") == 0)
-        	{
-  				#ifdef DEBUG
-  				printf("Inode doesnt exist!! for the path %s\n", path);
-  				#endif
-  				*ino = -1;
-  			}
-  			else
-        	{
-          		printf("INODE FOUND !!! \n\n\n");
-
-  				*ino = (temp -> file_inode);
-          		inode *temp_ino = inodes + ((*ino) * sizeof(inode));
-  				if(temp_ino -> directory)
-          		{
-  					temp = (dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE));
-  				}
-
-  			}
-  			token = strtok(NULL, "/");
-  		}
-	}
+	inval_queue[(inval_head + inval_count) % inval_len] = strdup(path);
+	inval_count++;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
 }
 
 
-//Traverse the path till "/", and check the dirent for pointer to inode 
-//inode -> check the bool variable 
-int isDir(char *path)
+//Drains the invalidation queue, started from fs_init
+void *invalidate_worker(void *arg)
 {
+	(void) arg;
 
-  //if root => directory
-	if (strcmp("/", path) == 0)
-  	{
-		return 1;
-	}
+	pthread_mutex_lock(&inval_lock);
+	while(!inval_stop)
+	{
+		if(inval_count == 0)
+		{
+			pthread_cond_wait(&inval_cond, &inval_lock);
+			continue;
+		}
 
-	else
-  	{
-		char *token = strtok(path, "/");
-		dirent *temp;
-		temp = root_directory;
-	
-		int dir = -1;
-    	while (token != NULL)
-    	{
-    		while(((strcmp(temp -> filename, "") != 0) || (temp -> file_inode) != 0))
-      		{
-				if((strcmp(temp -> filename, "") != 0))
-        		{
-					if((strcmp(temp -> filename, token) == 0))
-          			{
-						break;
-					}
-				}
-				temp ++;
-
-			}
-
-			if((strcmp(temp -> filename, "") == 0) && temp -> file_inode == 0)
-      		{
-				#ifdef DEBUG
-				printf("Invalid Path - %s\n", path);
-				#endif
-				return -1;
-				// Invalid path
-			}
-
-			else
-      		{
-        		inode *temp_ino = inodes + ((temp -> file_inode) * sizeof(inode));
-
-        		//if bool is true
-				if(temp_ino -> directory)
-        		{
-					dir = 1;
-				}
-				else
-        		{
-					dir = 0;
-				}
-
-				if(dir == 1)
-				{
-					temp = (dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE));
-				}
-				// not handled : case where file/directory is there
-
-			}
-  			token = strtok(NULL, "/");
-  		}
+		char *path = inval_queue[inval_head];
+		inval_head = (inval_head + 1) % inval_len;
+		inval_count--;
+		pthread_mutex_unlock(&inval_lock);
 
+		//-ENOENT only means the kernel never looked the path up, so it has nothing cached
+		int res = fuse_invalidate_path(fuse_handle, path);
 		#ifdef DEBUG
-		if(dir == 0)
-    	{
-			printf("%s - FILE\n", path);
-		}
-		else if(dir == 1)
-    	{
-			printf("%s - DIRECTORY\n", path);
-		}
-		else
-    	{
-			printf("%s - ERROR PATH\n", path);
-		}
+		printf("invalidate %s - %d\n", path, res);
 		#endif
-  		return dir;
+		(void) res;
+		free(path);
+
+		pthread_mutex_lock(&inval_lock);
 	}
+	pthread_mutex_unlock(&inval_lock);
+	return NULL;
+}
+
+
+//myfs_readdir callback, stops once the kernel's buffer is full
+//The entry's type goes along so that listings don't cost a getattr per entry
+int fill_dir(void *arg, const char *name, int ino, bool dir)
+{
+	readdir_state *state = arg;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = dir ? S_IFDIR : S_IFREG;
+	return state -> filler(state -> buf, name, &st, 0, 0);
 }
 
-//Sets the parameters for the free location found in inode bit map
-void allocate_inode(char *path, int *ino, bool dir)
+//---------------------------------------------------------------------------------------FUSE FUNCTIONS--------------------------------------------------------------------------------------------------
+
+// Negotiate kernel caching: entries, attributes and pages are cached for long timeouts
+// and every change we make is pushed back to the kernel through invalidate_path
+// Writes go through the kernel's writeback cache when it offers one, so that small application writes
+// reach us as large requests, and reads may be sent in parallel
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-	//*ino = return_first_unused_inode(inodes);
 	#ifdef DEBUG
-	printf("ALLOCATING INODE\n");
-	printf("inode address to allocate : %u\n", *ino);
+	printf("init\n");
 	#endif
 
-	//position the pointer to correct address
-	inode *temp_ino = inodes + ((*ino) * sizeof(inode));
+	if(conn -> capable & FUSE_CAP_WRITEBACK_CACHE)
+	{
+		conn -> want |= FUSE_CAP_WRITEBACK_CACHE;
+		writeback = true;
+	}
+	if(conn -> capable & FUSE_CAP_ASYNC_READ)
+	{
+		conn -> want |= FUSE_CAP_ASYNC_READ;
+	}
+	conn -> max_write = MAX_IO_SIZE;
+	conn -> max_readahead = MAX_IO_SIZE;
+
+	cfg->entry_timeout = ENTRY_TIMEOUT;
+	cfg->attr_timeout = ATTR_TIMEOUT;
+	cfg->negative_timeout = NEGATIVE_TIMEOUT;
+	cfg->kernel_cache = 1;
 
-	temp_ino -> id = rand() % 5000;
-	temp_ino -> size = 0;
-	temp_ino -> data = return_offset_of_first_free_datablock(freemap);
-	temp_ino -> directory = dir;
-	temp_ino -> last_accessed = 0;
-	temp_ino -> last_modified = 0;
+	fuse_handle = fuse_get_context()->fuse;
+	pthread_create(&inval_thread, NULL, invalidate_worker, NULL);
 
-  	if(dir)
-  	{
-    	temp_ino -> link_count = 2;
-  	}
-  	else
-  	{
-    	temp_ino -> link_count = 1;
-  	}
+	if(myfs_set_engine(ctx, options.engine) != 0)
+	{
+		fprintf(stderr, "%s engine unavailable, falling back to sync\n", options.engine);
+	}
+	return NULL;
 }
 
 
-//Print inode related things
-void print_inode(inode *i)
+static void fs_destroy(void *private_data)
 {
-	printf("used : %d\n", i -> used);
-	printf("id : %d\n", i -> id);
-	printf("size : %d\n", i -> size);
-	printf("data : %u\n", i -> data);
-	printf("directory : %d\n", i -> directory);
-	printf("last_accessed : %d\n", i -> last_accessed);
-	printf("last_modified : %d\n", i -> last_modified);
-	printf("link_count : %d\n", i -> link_count);
+	(void) private_data;
+
+	pthread_mutex_lock(&inval_lock);
+	inval_stop = true;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
+	pthread_join(inval_thread, NULL);
+
+	myfs_unmount(ctx);
+	ctx = NULL;
+
+	//whatever is still queued is moot, the kernel is dropping the mount
+	while(inval_count > 0)
+	{
+		free(inval_queue[inval_head]);
+		inval_head = (inval_head + 1) % inval_len;
+		inval_count--;
+	}
+	free(inval_queue);
+	inval_queue = NULL;
+	inval_len = 0;
 }
 
-//---------------------------------------------------------------------------------------FUSE FUNCTIONS--------------------------------------------------------------------------------------------------
 
 static int fs_getattr(const char *path, struct stat *stbuf,
   		       struct fuse_file_info *fi)
@@ -460,94 +377,36 @@ static int fs_getattr(const char *path, struct stat *stbuf,
   	#ifdef DEBUG
   	printf("%s\n", path);
   	#endif
+  	(void) fi;
 
-  	int res = 0;
-
-  	char *path2;
-  	path2 = (char *)malloc(sizeof(path));
-  	strcpy(path2, path);
-
-    //buffer to get the attributes
-  	memset(stbuf, 0, sizeof(struct stat));
-
-  	int ino;
-  	path_to_inode(path, &ino); //find inode using the path
-
-  	int directory_flag = isDir(path2); //check if it is a directory
-
-  	if (directory_flag == 1) 
-    {
-  		printf("getattr - Directory\n");
-  		stbuf->st_mode = S_IFDIR | 0777;
-  		stbuf->st_nlink = 2;
-  	}
-
-  	else if (directory_flag == 0)
-    {
-      	inode *temp_ino = inodes + (ino * sizeof(inode));
-  		stbuf->st_mode = S_IFREG | 0444;
-  		stbuf->st_nlink = 1;
-  		stbuf->st_size = temp_ino -> size;
-  		stbuf->st_blocks = (int)((temp_ino->size)+512)/512;
-  	}
-
-  	else
+  	int ino = myfs_lookup(ctx, path); //find inode using the path, the inode itself says if it is a directory
+  	if (ino < 0)
     {
-  		res = -ENOENT;
+  		return ino;
   	}
-  	return res;
+  	return myfs_stat(ctx, ino, stbuf);
 }
 
 static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+		       off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
 	#ifdef DEBUG
   	printf("ReadDir - %s\n", path);
   	#endif
   	(void) offset;
   	(void) fi;
-  	
-  	int ino; //inode index in the array
-  	path_to_inode(path, &ino);// read the path to find the inode
-
-  	printf("ino returned for %s - %d\n", path, ino);
+  	(void) flags;
 
-    //if inode not found
-  	if (ino == -1)
+  	int ino = myfs_lookup(ctx, path);// read the path to find the inode
+  	if (ino < 0)
     {
-  		return -ENOENT;
+  		return ino;
   	}
 
-  	else
-    {
-  		dirent *temp;
-  		filler(buf, ".", NULL, 0);
-  		filler(buf, "..", NULL, 0);
-  		//printf("filled some stuff\n");
-
-      	//if directory is root
-  		if(strcmp(path, "/") == 0)
-      	{
-  			temp = root_directory;
-  		}
-
-      	//get the dirent using inode found at inode number
-  		else
-      	{
-        	inode *temp_ino = inodes + (ino * sizeof(inode));
-  			temp = (dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE));	
-  		}
-
-      	//read all files/entries in the DIR in a loop
-  		while((strcmp(temp -> filename, "") != 0))
-      	{
-  			//printf("I'm here\n");
-  			filler(buf, temp -> filename, NULL, 0);
-  			temp++;
-  			//temp = (dirent *)temp
-  		}
-  	}
-  	return 0;
+  	readdir_state state = { buf, filler };
+  	filler(buf, ".", NULL, 0, 0);
+  	filler(buf, "..", NULL, 0, 0);
+  	return myfs_readdir(ctx, ino, fill_dir, &state);
 }
 
 
@@ -557,60 +416,16 @@ static int fs_mkdir(const char *path, mode_t mode)
   	#ifdef DEBUG
   	printf("mkdir\n");
   	printf("%s\n", path);
-  	printf("%d", mode);
+  	printf("%d\n", mode);
   	#endif
 
-    //ALLOCATE AND SET new directory
-
-    //find free inode -> set inode parameters at index
-  	int ino = return_first_unused_inode(inode_map);
-  	allocate_inode(path, &ino, true);
-
-    //access the inode
-    inode *temp_ino = inodes + (ino * sizeof(inodes));
-  	print_inode(temp_ino);
-  	printf("inode address for %s - %u\n", path, ino);
-
-  	// go through the path
-  	char *token = strtok(path, "/");
-  	dirent *temp;
-  	temp = root_directory;
-
-  	while (token != NULL)
-    {
-  		printf("token = %s\n", token);
-  		printf("temp -> filename = %s\n", temp->filename);
-
-  		while((strcmp(temp -> filename, "") != 0) && (strcmp((temp -> filename), token) != 0))
-      	{
-  			temp++;
-  		}
-
-  		if((strcmp(temp -> filename, "") == 0))
-      	{
-  			// Add the new directory to temp
-  			//printf("HERE\n");
-  			temp = (dirent *)temp;
-  			//printf("temp = %u\n temp -> filename = %u\n", temp, temp -> filename);
-  			//(temp -> filename) = (char *)malloc(15);
-  			strcpy((temp -> filename), token);
-  			temp -> file_inode = ino;
-
-        	printf("\n\nPersisting the directory creation\n\n");
-        	lseek(fs_file, 0, SEEK_SET);
-        	write(fs_file, fs, FS_SIZE);
-  			return 0;
-  		}
-  		else
-      	{
-        	temp_ino = (inodes + ((temp -> file_inode) * sizeof(inode)));
-  			if(temp_ino -> directory)
-        	{
-  				temp = (dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE));
-  			}
-  		}
-  		token = strtok(NULL, "/");
+  	int ino = myfs_mkdir(ctx, path);
+  	if(ino < 0)
+  	{
+  		return ino;
   	}
+  	parent_changed(path);
+  	return 0;
 }
 
 //remove a directory only if the directory is empty
@@ -622,106 +437,59 @@ static int fs_rmdir(const char *path)
 	printf("path : %s\n", path);
 	#endif
 
-	int i;
-	//start from back and get the last directory
-	i = strlen(path);
-	while(path[i] != '/')
+	int res = myfs_rmdir(ctx, path);
+	if(res != 0)
 	{
-		i--;
+		return res;
 	}
 
-	char *subpath;
-	subpath = (char *)malloc(strlen(path)+ 1);
-
-	//basically not including the non directory part
-	strncpy(subpath, path, i);
-	subpath[i] = '/';
-	subpath[i+1] = '\0';
-
-	#ifdef DEBUG
-	printf("Subpath = %s\n", subpath);
-	printf("Name of directory to delete = %s\n", path + (i+1));
-	#endif
-
-	int ino;
-	dirent *temp;
-	dirent *temp_data;
-	inode *temp_ino;
-
-	//if root 
-	if(strcmp(subpath, "/") == 0)
-	{
-	  	temp = root_directory;
-	}
+	invalidate_path(path);
+	parent_changed(path);
+	return 0;
+}
 
-	//get inode number using the original path given -> and thus the dirent
-	else
-	{
-	  	path_to_inode(subpath, &ino);
-	  	printf("Inode for the path - %s - %d\n", path, ino);
 
-	  	temp_ino = inodes + (ino * sizeof(inode)); //get inode at offset
-		temp = datablks + ((temp_ino->data) * BLK_SIZE); // get dirent using the inode
-	}
+// Implemented in Copy
+static int fs_rename(const char *from, const char *to, unsigned int flags)
+{
+	return -1;
+}
 
-	//do similar for the subpath = to check if the directory is empty or not
 
-	printf("ino -> data = %u\n", temp);
-	printf("root_directory = %u\n", root_directory);
+// To truncate a file and write
+static int fs_truncate(const char *path, off_t size,struct fuse_file_info *fi)
+{
+	#ifdef DEBUG
+	printf("truncate %s - %ld\n", path, (long)size);
+	#endif
+	(void) fi;
 
-	while(((strcmp(temp -> filename, "") != 0) || (temp -> file_inode) != 0) && strcmp(path + (i+1), temp -> filename) != 0)
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
 	{
-		temp ++;
+		return ino;
 	}
 
-	if((strcmp(temp -> filename, "") != 0))
+	int res = myfs_truncate(ctx, ino, size);
+	if(res == 0 && !writeback)
 	{
-	 	//printf("I'm here!!");
-	  	printf("temp -> file_inode = %d\n", temp -> file_inode);
-
-		if(temp -> file_inode != 0)
-  		{
-		    temp_ino = inodes + ((temp -> file_inode) * sizeof(inode));
-		    temp_data = ((dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE)));
-
-		    //directory has stuff
-		    if(strcmp((temp_data -> filename), "") != 0)
-		    {
-					
-      			#ifdef DEBUG
-				printf("Directory isnt empty!!\n");
-				#endif
-
-				return -1;
-			}
-
-	    	//if it is empty -> free the bitmaps(inode and the databitmap)
-			strcpy(temp ->filename, "");
-			freemap[(temp_ino -> data)] = 1;
-			inode_map[(temp -> file_inode)] = 0;
-
-		}
+		invalidate_path(path);
 	}
-
-	printf("\n\nPersisting the directory deletion\n\n");
-	lseek(fs_file, 0, SEEK_SET);
-	write(fs_file, fs, FS_SIZE);
-
-	return 0;
+	return res;
 }
 
 
-// Implemented in Copy
-static int fs_rename(const char *from, const char *to, unsigned int flags)
+// The kernel's own times after writeback, and touch
+static int fs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
 {
-	return -1;
-}
-
+	(void) fi;
 
-// To truncate a file and write
-static int fs_truncate(const char *path, off_t size,struct fuse_file_info *fi)
-{
-	return -1;
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_utimens(ctx, ino, tv);
 }
 
 
@@ -732,49 +500,15 @@ static int fs_create(const char *path, mode_t mode,struct fuse_file_info *fi)
   	#ifdef DEBUG
   	printf("\tCreate called\n");
   	#endif
+  	(void) mode;
+  	(void) fi;
 
-    //Finds the first free inode and initializes it
-  	int ino = return_first_unused_inode(inode_map);
-  	allocate_inode(path, &ino, false);
-
-    //Root - starting point
-  	char *token = strtok(path, "/");
-  	dirent *temp;
-  	temp = root_directory;
-  	
-  	char *file = (char *)malloc(15);
-  	while (token != NULL)
-    {
-  		
-      	//loop till the end of the path
-  		while((strcmp(temp -> filename, "") != 0) && (strcmp(temp -> filename, token) != 0))
-      	{
-  			temp++;
-  		}
-
-      	//if it is end of path , attach the inode and set dirent
-  		if((strcmp(temp -> filename, "") != 0))
-      	{
-          	inode *temp_ino = inodes + ((temp -> file_inode) * sizeof(inode));
-			if(temp_ino -> directory)
-          	{
-				temp = datablks + ((temp_ino -> data) * BLK_SIZE);
-			}
-			else
-          	{
-				return -1;
-			}
-  		}
-
-  		strcpy(file, token);
-  		token = strtok(NULL, "/");
+  	int ino = myfs_create(ctx, path);
+  	if(ino < 0)
+  	{
+  		return ino;
   	}
-
-  	strcpy(temp -> filename, file);
-  	temp -> file_inode = ino;
-    printf("\n\nPersisting the create!!\n\n");
-    lseek(fs_file, 0, SEEK_SET);
-    printf("%d\n", write(fs_file, fs, FS_SIZE));
+  	parent_changed(path);
   	return 0;
 }
 
@@ -786,15 +520,15 @@ static int fs_open(const char *path, struct fuse_file_info *fi)
 	printf("Opening File - %s\n", path);
 	#endif
 
-	int ino;
-	path_to_inode(path, &ino);
-	printf("inode returned = %u\n", ino);
-
-	if(ino == -1)
+	int ino = myfs_open(ctx, path, fi -> flags);
+	if(ino < 0)
 	{
-		return -1;
+		return ino;
 	}
 
+	//pages stay valid across opens, writers invalidate them explicitly (or wrote them in the kernel's cache)
+	fi -> keep_cache = 1;
+
 	#ifdef DEBUG
 	printf("Successful open\n");
 	#endif
@@ -805,48 +539,66 @@ static int fs_open(const char *path, struct fuse_file_info *fi)
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_file_info *fi)
 {
-	int ino;
-	path_to_inode(path, &ino);
-	size_t len;
 	(void) fi;
 
-	if(ino == -1)
-		return -ENOENT;
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_read(ctx, ino, buf, size, offset);
+}
+
 
-	inode *temp_ino = (inodes + (ino * sizeof(inode)));
-	len = temp_ino->size;
+static int fs_write(const char *path, const char *buf, size_t size,off_t offset, struct fuse_file_info *fi)
+{
+	#ifdef DEBUG
+	printf("Write called!!\n");
+	#endif
+	(void) fi;
 
-	if (offset < len) 
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
 	{
-		if (offset + size > len)
-			size = len - offset;
-  		char *temp_data = datablks + ((temp_ino -> data) * BLK_SIZE);
-		memcpy(buf, temp_data + offset, size);
-	} 
-
-	else
-		size = 0;
+		return ino;
+	}
 
-	return size;
+	//with the writeback cache the data came out of the kernel's own pages, which are already up to date
+	int res = myfs_write(ctx, ino, buf, size, offset);
+	if(res >= 0 && !writeback)
+	{
+		invalidate_path(path);
+	}
+	return res;
 }
 
 
-static int fs_write(const char *path, const char *buf, size_t size,off_t offset, struct fuse_file_info *fi)
+// Only SEEK_DATA and SEEK_HOLE reach us, the kernel handles the others itself
+static off_t fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
 {
 	#ifdef DEBUG
-	printf("Write called!!\n");
+	printf("lseek %s - %ld %d\n", path, (long)off, whence);
 	#endif
+	(void) fi;
 
-	int ino;
-	path_to_inode(path, &ino);
-	inode *temp_ino = inodes + (ino * sizeof(inode));
-	memcpy(((datablks + ((temp_ino -> data) * BLK_SIZE)) + offset), (buf), size);
-	temp_ino -> size = (temp_ino -> size) +  size;
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_lseek(ctx, ino, off, whence);
+}
 
-	printf("\n\nPersisting the write\n\n");
-	lseek(fs_file, 0, SEEK_SET);
-	printf("%d\n", write(fs_file, fs, FS_SIZE));
-	return 0;
+
+// For df, which sees the space of small files in fragments
+static int fs_statfs(const char *path, struct statvfs *st)
+{
+	#ifdef DEBUG
+	printf("statfs %s\n", path);
+	#endif
+	(void) path;
+
+	return myfs_statfs(ctx, st);
 }
 
 
@@ -857,71 +609,65 @@ static int fs_rm(const char *path)
   	printf("rm called\n");
   	#endif
 
-    int i;
-  	i = strlen(path);
-  	while(path[i] != '/')
-    {
-  		i--;
+  	int res = myfs_unlink(ctx, path);
+  	if(res != 0)
+  	{
+  		return res;
   	}
 
-  	char *subpath;
-  	subpath = (char *)malloc(strlen(path)+ 1);
-  	strncpy(subpath, path, i);
-  	subpath[i] = '/';
-  	subpath[i+1] = '\0';
+  	invalidate_path(path);
+  	parent_changed(path);
+  	return 0;
+}
 
-  	#ifdef DEBUG
-  	printf("Subpath = %s\n", subpath);
-  	printf("Name of directory to delete = %s\n", path + (i+1));
-  	#endif
 
-  	int ino;
-    dirent *temp;
-    dirent *temp_data;
-    inode *temp_ino;
+static int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	#ifdef DEBUG
+	printf("setxattr %s - %s\n", path, name);
+	#endif
 
-    //if root
-    if(strcmp(subpath, "/") == 0)
-    {
-      	temp = root_directory;
-    }
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_setxattr(ctx, ino, name, value, size, flags);
+}
 
-    //original path
-    else
-    {
-      	path_to_inode(subpath, &ino);
-      	printf("Inode for the path - %s - %d\n", path, ino);
 
-      	temp_ino = inodes + (ino * sizeof(inode));
-    	temp = datablks + ((temp_ino->data) * BLK_SIZE);
-    }
+static int fs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_getxattr(ctx, ino, name, value, size);
+}
 
-    //subpath
 
-  	printf("ino -> data = %u\n", temp);
-  	printf("root_directory = %u\n", root_directory);
+static int fs_listxattr(const char *path, char *list, size_t size)
+{
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_listxattr(ctx, ino, list, size);
+}
 
-  	while(((strcmp(temp -> filename, "") != 0) || (temp -> file_inode) != 0) && strcmp(path + (i+1), temp -> filename) != 0)
-  	{
-  		temp ++;
-  	}
 
-  	if((strcmp(temp -> filename, "") != 0))
-    {
-      	printf("I'm here!!");
-      	printf("temp -> file_inode = %d\n", temp -> file_inode);
-  		if(temp -> file_inode != 0)
-      	{
-        	temp_ino = inodes + ((temp -> file_inode) * sizeof(inode));
-        	temp_data = ((dirent *)(datablks + ((temp_ino -> data) * BLK_SIZE)));
-  			strcpy(temp ->filename, "");
-  			//freemap[(temp_ino -> data)] = 1;
-  			inode_map[(temp -> file_inode)] = 0;
-  		}
-  	}
+static int fs_removexattr(const char *path, const char *name)
+{
+	#ifdef DEBUG
+	printf("removexattr %s - %s\n", path, name);
+	#endif
 
-    printf("\n\nPersisting the file deletion\n\n");
-    lseek(fs_file, 0, SEEK_SET);
-    write(fs_file, fs, FS_SIZE);
-  	return 0;
+	int ino = myfs_lookup(ctx, path);
+	if(ino < 0)
+	{
+		return ino;
+	}
+	return myfs_removexattr(ctx, ino, name);
 }
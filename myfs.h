@@ -0,0 +1,171 @@
+#ifndef MYFS_H
+#define MYFS_H
+
+// On-disk format of a MyFileSystem image, shared by myfs and fsck.myfs
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+// Layout
+#define BLK_SIZE (1 << 12)
+
+#define N_INODES 100
+#define DBLKS_PER_INODE 16								// Entries in an inode's block map
+#define DBLKS (DBLKS_PER_INODE * N_INODES)
+#define NO_BLOCK -1										// Unused slot of a block map
+#define MAX_FILE_SIZE (DBLKS_PER_INODE * BLK_SIZE)		// Largest file, every slot of the block map in use
+
+// Fragments: a file of at most FRAG_MAX bytes keeps them in a run of FRAG_SIZE slots
+// of a block it shares with other small files, rather than in a block of its own
+#define FRAG_SIZE 512
+#define FRAGS_PER_BLK (BLK_SIZE / FRAG_SIZE)
+#define FRAG_MAX (BLK_SIZE - FRAG_SIZE)
+
+// Large blocks: once LARGE_THRESHOLD bytes of a LARGE_BLKS stretch of the map have blocks, they move to
+// their places in a run of LARGE_BLKS free blocks (aligned to LARGE_BLKS) taken in one go, holes stay holes
+#define LARGE_BLKS 16
+#define LARGE_THRESHOLD ((LARGE_BLKS - 4) * BLK_SIZE)
+
+// Freemap entries: 1 free, 0 used by one owner, FRAG_BLOCK | a bit per used slot for a block of fragments
+#define FRAG_BLOCK 0x100
+#define FRAG_BITS(n, first) ((((1 << (n)) - 1) << (first)) & 0xff)
+
+
+// Structure for Inodes
+typedef struct
+{
+	bool used;                  // Checks the validity of the inodes, whether it is available
+    int id;						// ID for the inode
+    size_t size;				// Size of the file
+    int data[DBLKS_PER_INODE];	// Block map: the i-th block of the file or directory, NO_BLOCK if there is none
+    signed char frag;			// First slot of the file's fragments in data[0] (and no other blocks), -1 if it has whole blocks
+    unsigned char n_frags;		// Slots in the run, they hold the file's first n_frags * FRAG_SIZE bytes
+    bool directory;				// Checks if the entity is a Directory or a File
+    int link_count; 			// Link Count: 2 -> Directory, 1 -> File
+    int last_accessed;			// Last accessed time
+    int last_modified;			// Last modified time
+    int xattr_blk;				// Shared block holding the attributes that don't fit inline, 0 if none
+    unsigned char xattr_inline[64];	// Extended area: small attributes packed as xattr_entry records
+} __attribute__((packed, aligned(1))) inode;
+
+
+// Structure for Directory Entry, variable length
+// The records of a directory block chain through rec_len and the last one reaches the end of the block,
+// any room between the end of a record's name and the next record is free space for new entries
+// A record with name_len 0 is free (a block's first record when everything in it was deleted)
+typedef struct
+{
+	int file_inode;
+	unsigned short rec_len;		// Bytes from this record to the next one
+	unsigned char name_len;
+	unsigned char type;			// FT_REG or FT_DIR, so listings don't need the inode
+	char name[];				// Not terminated
+} dirent;
+
+#define FT_REG 1
+#define FT_DIR 2
+
+#define DIRENT_HDR_SIZE offsetof(dirent, name)
+#define DIRENT_LEN(name_len) ((DIRENT_HDR_SIZE + (name_len) + 3) & ~3)	// Room a record needs, kept 4 byte aligned
+#define MYFS_NAME_MAX 255
+
+
+// Structure for an Extended Attribute, the name is followed by the value, neither is terminated
+// A list of them ends at a name_len of 0 or at the end of its area
+typedef struct
+{
+	unsigned char name_len;
+	unsigned short value_len;
+	char data[];
+} __attribute__((packed)) xattr_entry;
+
+
+// Header of a shared xattr block, followed by its xattr_entry records
+// Inodes with identical attribute sets point at the same block
+typedef struct
+{
+	int refcount;				// Inodes using this block
+	unsigned int hash;			// Hash of the records, to find identical sets
+	int used;					// Bytes of records after the header
+} xattr_header;
+
+
+// The inode and data space is split into allocation groups, each with its own
+// slice of inode_map/freemap, free counters and lock
+#define N_GROUPS 4
+#define INODES_PER_GROUP (N_INODES / N_GROUPS)
+#define BLKS_PER_GROUP (DBLKS / N_GROUPS)
+
+#define ROUND_UP_DIV(x, y) (((x) + (y) - 1) / (y))
+
+#define MYFS_MAGIC 0x4d594653							// "MYFS", only empty images are formatted on mount
+#define MYFS_VERSION 6									// Bumped whenever the layout changes
+
+
+// Allocation group descriptor
+// Padded to a cache line so that CPUs working in different groups never share one
+// (the image is loaded block aligned, so the padding lines up with real cache lines)
+typedef struct
+{
+	int free_inodes;
+	int free_blocks;
+	int n_dirs;					// Directories placed in this group, new ones go where there are fewer
+} __attribute__((aligned(64))) group_desc;
+
+
+// Superblock, the first block of the image
+typedef struct
+{
+	int magic;
+	int version;
+	int n_groups;
+	int inodes_per_group;
+	int blocks_per_group;
+	int root_inode;
+	int n_devices;				// Data files the data blocks are striped over, 0 if they follow the metadata in the image
+	int stripe_blks;			// Blocks in a stripe unit, consecutive units go to consecutive data files
+	unsigned char uuid[16];		// Random at format, each data file carries it in its device_header
+	group_desc groups[N_GROUPS];
+} superblock;
+
+
+#define SUPER_BLKS ROUND_UP_DIV(sizeof(superblock), BLK_SIZE)
+#define INODE_MAP_BLKS ROUND_UP_DIV(N_INODES*sizeof(int), BLK_SIZE)
+#define INODE_BLKS ROUND_UP_DIV(N_INODES*sizeof(inode), BLK_SIZE)
+#define FREEMAP_BLKS ROUND_UP_DIV(DBLKS*sizeof(int), BLK_SIZE)
+
+#define META_BLKS (SUPER_BLKS + INODE_MAP_BLKS + INODE_BLKS + FREEMAP_BLKS)
+#define FS_BLKS (META_BLKS + DBLKS)
+#define FS_SIZE (FS_BLKS * BLK_SIZE)
+
+
+// Striped images: the image file holds only the META_BLKS of metadata, data block blk lives in
+// data file STRIPE_DEVICE at byte STRIPE_OFFSET, n being sb -> n_devices and stripe sb -> stripe_blks
+// Each data file starts with a block holding its device_header, the stripe units follow it
+#define MAX_DEVICES 8
+#define DEVICE_HDR_BLKS 1
+#define STRIPE_DEVICE(blk, n, stripe) (((blk) / (stripe)) % (n))
+#define STRIPE_OFFSET(blk, n, stripe) ((off_t)(DEVICE_HDR_BLKS + ((blk) / (stripe)) / (n) * (stripe) + (blk) % (stripe)) * BLK_SIZE)
+
+#define DEVICE_MAGIC 0x4d594644							// "MYFD"
+
+// Header of a data file, written at format: the image it belongs to and its place in the mount order,
+// so that a file of another image or files given in the wrong order are refused
+typedef struct
+{
+	int magic;
+	int version;
+	unsigned char uuid[16];		// The image's sb -> uuid
+	int device;					// Index of the file in the mount order
+	int n_devices;
+} device_header;
+
+#define ROOT_INODE 0									// Inode 0 (and data block 0, its first) is the root directory
+
+#define XATTR_INLINE_SIZE sizeof(((inode *)0) -> xattr_inline)
+#define XATTR_BLK_SPACE (BLK_SIZE - sizeof(xattr_header))
+#define XATTR_ENTRY_SIZE(e) (sizeof(xattr_entry) + (e) -> name_len + (e) -> value_len)
+
+#endif